@@ -1,3 +1,31 @@
 #pragma once
 
 #include "led_config.h"
+
+/* Report the wheel in hi-res units, with room in each report for the
+ * many units a fast flick moves */
+#define POINTING_DEVICE_HIRES_SCROLL_ENABLE
+#define WHEEL_EXTENDED_REPORT
+
+/* Give each trackball its own backoff after a collision, apart from the
+ * keyboard's default LED_DEVICE_ID of 0 */
+#ifndef LED_DEVICE_ID
+#   ifdef IS_LEFT
+#   define LED_DEVICE_ID 1
+#   else
+#   define LED_DEVICE_ID 2
+#   endif
+#endif
+
+/* Define to keep scrolling after a flick, slowing down until it stops
+ * or the ball is touched again. The speed it needs and how quickly it
+ * slows down are set at the top of keymap.c.
+#define SCROLL_MOMENTUM
+ */
+
+/* Define to let the scrolling ball take over the pointer when it is
+ * moved on purpose, without waiting for a command from the keyboard.
+ * The distance and speed it takes are set at the top of keymap.c.
+ * With LED_CMD_ACK, this needs LED_CMD_ADDRESS as well.
+#define SCROLL_HANDOFF
+ */
@@ -21,254 +21,2100 @@
 #include "print.h"
 #endif
 
+#ifdef LED_CMD_RAW_HID
+#include "raw_hid.h"
+#endif
+
 /* State variables */
-static bool   num_lock_state    = false;
-static bool   caps_lock_state   = false;
-static bool   in_cmd_rec_window = false;
-static bool   in_cmd_snd_window = false;
+static uint8_t lock_state        = 0;
+static bool    in_cmd_rec_window = false;
+static bool    in_cmd_snd_window = false;
 
-/* Set the static state variables to match the host.
- *
- * This function should be called from keyboard_post_init_user. */
-void set_init_led_state(void) {
-    num_lock_state  = host_keyboard_led_state().num_lock;
-    caps_lock_state = host_keyboard_led_state().caps_lock;
+/* Deferred tokens for closing the windows early */
+static deferred_token rcv_window_token  = INVALID_DEFERRED_TOKEN;
+static deferred_token send_window_token = INVALID_DEFERRED_TOKEN;
+
+/* Outgoing commands waiting to be sent, oldest first */
+static uintptr_t      led_cmd_queue[LED_CMD_QUEUE_SIZE];
+static uint8_t        led_cmd_queue_head  = 0;
+static uint8_t        led_cmd_queue_count = 0;
+static deferred_token led_cmd_task_token  = INVALID_DEFERRED_TOKEN;
+static bool           led_cmd_waiting     = false;
+
+/* The command being sent, so the echo of each toggle can be tracked */
+static led_cmd_out *sending_cmd = NULL;
+
+/* How often the receiver has lost track of a frame and found one again */
+static led_rcv_counts_t led_rcv_count = { 0, 0, 0 };
+
+#ifdef LED_CMD_RAW_HID
+/* Whether the relay is answering, and the commands it hasn't
+ * acknowledged yet, oldest first */
+static bool           led_raw_relay = false;
+static bool           led_raw_pinged = false;
+static uint32_t       led_raw_ping_time = 0;
+static uint8_t        led_raw_seq = 0;
+static uintptr_t      led_raw_pending[LED_CMD_QUEUE_SIZE];
+static uint8_t        led_raw_pending_seq[LED_CMD_QUEUE_SIZE];
+static uint8_t        led_raw_pending_count = 0;
+static bool           led_raw_fallback = false;
+static deferred_token led_raw_token = INVALID_DEFERRED_TOKEN;
+#endif
+
+/* The timings from led_config.h */
+#define LED_TIMING_DEFAULT {                \
+    .num_wait     = LED_NUM_WAIT,           \
+    .caps_wait    = LED_CAPS_WAIT,          \
+    .scroll_wait  = LED_SCROLL_WAIT,        \
+    .between_wait = LED_BETWEEN_WAIT,       \
+    .cmd_timeout  = LED_CMD_TIMEOUT,        \
+    .self_wait    = LED_CMD_SELF_WAIT,      \
+    .rcv_quiet    = LED_RCV_QUIET,          \
+    .ack_timeout  = LED_TIMING_ACK,         \
+    .backoff_wait = LED_TIMING_BACKOFF      \
 }
 
-/* Close out the receive window and reset the cmd_window_state
- * struct to known defaults. This function is designed to be
- * deferred a certain time after the window opens. */
-uint32_t close_rcv_window(uint32_t trigger_time, void *cb_arg) {
-    cmd_window_state_t *cmd_window_state = (cmd_window_state_t *)cb_arg;
+#ifdef LED_CMD_ACK
+#define LED_TIMING_ACK LED_ACK_TIMEOUT
+#else
+#define LED_TIMING_ACK 0
+#endif
 
-#   ifdef CONSOLE_ENABLE
-    uprint("CLOSE_RCV_WINDOW\n");
+#ifdef LED_COLLISION_DETECT
+#define LED_TIMING_BACKOFF LED_BACKOFF_WAIT
+#else
+#define LED_TIMING_BACKOFF 0
+#endif
+
+#ifdef LED_CALIBRATE
+/* With calibration, the timings in use are kept here, and calibration
+ * runs once the channel is free */
+static led_timing_t   led_timing        = LED_TIMING_DEFAULT;
+static bool           led_cal_pending   = false;
+static bool           led_cal_active    = false;
+static uint8_t        led_cal_symbol    = 0;
+static uint8_t        led_cal_sample    = 0;
+static bool           led_cal_key_down  = false;
+static bool           led_cal_released  = false;
+static uint32_t       led_cal_pressed   = 0;
+static uint16_t       led_cal_longest[LED_CMD_LOCKS];
+static deferred_token led_cal_token     = INVALID_DEFERRED_TOKEN;
+
+/* Marks a lock that the host only toggled once its key was released */
+#define LED_CAL_ON_RELEASE 0xFFFF
+
+#define LED_TIMING(field, value) (led_timing.field)
+#else
+#define LED_TIMING(field, value) (value)
+#endif
+
+#ifdef LED_CMD_STATS
+/* Statistics, and when the current send and receive windows opened */
+static led_cmd_stats_t led_stats;
+static uint32_t        led_stats_send_start = 0;
+static uint32_t        led_stats_rcv_start  = 0;
+
+static void led_stats_count(uint16_t *counter) {
+    if (*counter < UINT16_MAX) {
+        (*counter)++;
+    }
+}
+
+/* Add a time to the bucket of the histogram that covers it */
+static void led_stats_time(led_stats_histogram_t *histogram, uint32_t since) {
+    uint32_t elapsed = timer_elapsed32(since);
+    uint8_t  bucket  = 0;
+
+    while ((bucket < LED_STATS_BUCKETS - 1) &&
+           (elapsed >= ((uint32_t)LED_STATS_FIRST_BUCKET << bucket))) {
+        bucket++;
+    }
+
+    led_stats_count(&histogram->counts[bucket]);
+
+    if (elapsed > histogram->max) {
+        histogram->max = (elapsed < UINT16_MAX) ? elapsed : UINT16_MAX;
+    }
+}
+
+#   if LED_STATS_INTERVAL > 0
+/* Deferred to print the statistics every LED_STATS_INTERVAL ms */
+static uint32_t led_stats_periodic(uint32_t trigger_time, void *cb_arg) {
+    led_cmd_stats_dump();
+    return(LED_STATS_INTERVAL);
+}
 #   endif
 
-    /* The conditional should not be required, but just in case... */
-    if (in_cmd_rec_window) {
-        in_cmd_rec_window = false;
+#define LED_STATS_COUNT(counter) led_stats_count(&led_stats.counter)
+#define LED_STATS_TIME(histogram, since) led_stats_time(&led_stats.histogram, since)
+#else
+#define LED_STATS_COUNT(counter)
+#define LED_STATS_TIME(histogram, since)
+#endif
 
-        cmd_window_state->bit_count = 0;
-        cmd_window_state->raw_led_cmd = 0;
-        cmd_window_state->num_lock_count = 0;
-        cmd_window_state->caps_lock_count = 0;
-        cmd_window_state->valid_cmd = true;
+/* Console messages from LED_LOG_EVENTS, each with up to two arguments.
+ * With LED_CMD_LOG they go to the event log, and otherwise they are
+ * printed straight away. */
+#define LED_LOG(event, ...) LED_LOG_ARGS(LOG_##event, ##__VA_ARGS__, 0, 0)
+
+#if defined(LED_CMD_LOG)
+#define LED_LOG_ARGS(event, arg0, arg1, ...) led_log(event, arg0, arg1)
+#elif defined(CONSOLE_ENABLE)
+static const char *const led_log_formats[] = { LED_LOG_EVENTS(LED_LOG_FORMAT) };
+
+#define LED_LOG_ARGS(event, arg0, arg1, ...) uprintf(led_log_formats[event], arg0, arg1)
+#else
+#define LED_LOG_ARGS(event, arg0, arg1, ...)
+#endif
+
+#ifdef LED_CMD_LOG
+/* The event log. Only the low 16 bits of the time are kept, which the
+ * decoder unwraps. */
+typedef struct {
+    uint16_t time;
+    uint8_t  event;
+    uint16_t arg0;
+    uint16_t arg1;
+} led_log_entry_t;
+
+static led_log_entry_t led_log_ring[LED_LOG_SIZE];
+static uint8_t         led_log_head  = 0;
+static uint8_t         led_log_count = 0;
+static uint16_t        led_log_lost  = 0;
+static deferred_token  led_log_token = INVALID_DEFERRED_TOKEN;
+#endif
+
+#ifdef LED_CMD_ACK
+/* Acknowledgement of the last command sent, and of received commands */
+static led_ack_state_t led_ack_state     = LED_ACK_IDLE;
+static deferred_token  led_ack_token     = INVALID_DEFERRED_TOKEN;
+static uintptr_t       led_ack_cmd       = 0;
+static uint8_t         led_ack_retries   = 0;
+static bool            led_ack_pending   = false;
+static uint8_t         led_ack_seq       = 0;
+static uint8_t         led_ack_last_seq  = 0xFF;
+static uintptr_t       led_ack_last_cmd  = 0;
+static uint32_t        led_ack_last_time = 0;
+static bool            led_ack_last      = false;
+#   ifdef LED_COLLISION_DETECT
+static bool            led_ack_resend    = false;
+#   endif
+#endif
+
+#ifdef LED_COLLISION_DETECT
+/* Collisions in a row for the command being sent, and the state of the
+ * random number generator for backoffs */
+static uint8_t  led_collisions   = 0;
+static uint32_t led_backoff_seed = 0;
+#endif
+
+static void led_send_echo(uint8_t locks);
+uint32_t start_led_cmd(uint32_t trigger_time, void *cb_arg);
+
+#ifdef LED_CALIBRATE
+static void led_cal_load(void);
+#endif
+
+#ifdef LED_CMD_RAW_HID
+static void led_raw_ping(void);
+#endif
+
+#ifdef LED_CMD_ACK
+/* Run the scheduler task right away, rather than at its next poll */
+static void led_cmd_kick(void) {
+    cancel_deferred_exec(led_cmd_task_token);
+    led_cmd_task_token = defer_exec(1, start_led_cmd, NULL);
+}
+#endif
+
+/* Called when a window closes, so a command waiting for the channel
+ * starts as soon as it is free. Devices that just collided are all
+ * waiting for the same window, so after a collision they are left to
+ * their backoff, or they would start again in step. */
+static void led_cmd_wake(void) {
+    if (led_cmd_waiting) {
+        led_cmd_waiting = false;
+
+#       ifdef LED_COLLISION_DETECT
+        if (led_collisions > 0) {
+            return;
+        }
+#       endif
+
+        extend_deferred_exec(led_cmd_task_token, 1);
+    }
+}
+
+#if defined(LED_CMD_ACK) || defined(LED_COLLISION_DETECT)
+
+/* Put a command back at the front of the queue to be sent again */
+static void led_cmd_requeue(uintptr_t led_cmd) {
+    if (led_cmd_queue_count == LED_CMD_QUEUE_SIZE) {
+        LED_LOG(LED_CMD_QUEUE_FULL);
+        return;
+    }
+
+    led_cmd_queue_head = (led_cmd_queue_head + LED_CMD_QUEUE_SIZE - 1) % LED_CMD_QUEUE_SIZE;
+    led_cmd_queue[led_cmd_queue_head] = led_cmd;
+    led_cmd_queue_count++;
+}
+#endif
+
+#ifdef LED_CMD_ACK
+/* Forget the last command received, so the next one with the same
+ * sequence bit is processed rather than taken for a retry */
+static void led_ack_forget(void) {
+    led_ack_last_seq = 0xFF;
+}
+
+/* Deferred after a command is sent. If no acknowledgement has arrived,
+ * the command is sent again, up to LED_CMD_RETRIES times, waiting twice
+ * as long for each retry. If the acknowledgement started but the lock
+ * never came back, the report was lost, so just move on. */
+uint32_t led_ack_timeout(uint32_t trigger_time, void *cb_arg) {
+    led_ack_token = INVALID_DEFERRED_TOKEN;
+
+    if ((led_ack_state == LED_ACK_WAIT) && (led_ack_retries < LED_CMD_RETRIES)) {
+        LED_LOG(LED_CMD_RETRY, led_ack_cmd);
+        led_ack_retries++;
+        led_cmd_requeue(led_ack_cmd);
+    } else {
+        if (led_ack_state == LED_ACK_WAIT) {
+            LED_LOG(LED_CMD_NO_ACK, led_ack_cmd);
+        }
+        led_ack_retries = 0;
     }
 
+    led_ack_state = LED_ACK_IDLE;
+    led_cmd_kick();
     return 0;
 }
+#endif
 
-/* This is the function that tracks incoming commands and processes
- * receiving them. It calls out to a (presumably) user-defined
- * process_led_cmd function when a complete command is received.
- *
- * This function should be called from led_update_user. */
-bool led_update_cmd(led_t led_state) {
-    static cmd_window_state_t cmd_window_state = {
-      .bit_count = 0,
-      .raw_led_cmd = 0,
-      .num_lock_count = 0,
-      .caps_lock_count = 0,
-      .valid_cmd = true
-    };
+/* Pack the locks used for commands into a mask, with the bit for each
+ * lock at the position of the symbol it sends, so a toggled lock can
+ * be turned straight into a symbol. */
+static uint8_t led_cmd_locks(led_t led_state) {
+    uint8_t locks = 0;
 
-    /* Only process if not currently sending a command and an appropriate state changed */
-    if ((!in_cmd_snd_window) &&
-        ((led_state.num_lock != num_lock_state) || (led_state.caps_lock != caps_lock_state))) {
+    if (led_state.num_lock) {
+        locks |= 1 << NUM_LOCK_BIT;
+    }
 
-        /* Open command window and start timer to it if we are not
-         * already in the middle of one. */
-        if (!in_cmd_rec_window) {
-#           ifdef CONSOLE_ENABLE
-                uprint("OPEN_RCV_WINDOW\n");
-#           endif
+    if (led_state.caps_lock) {
+        locks |= 1 << CAPS_LOCK_BIT;
+    }
 
-            in_cmd_rec_window = true;
-            defer_exec(LED_CMD_TIMEOUT, close_rcv_window, &cmd_window_state);
+#   ifdef LED_SCROLL_LOCK_CODING
+    if (led_state.scroll_lock) {
+        locks |= 1 << SCROLL_LOCK_BIT;
+    }
+#   endif
+
+    return(locks);
+}
+
+#ifdef LED_CMD_HUFFMAN
+/* Codeword and length in symbols for each command. Commands that are
+ * never sent have a length of zero. */
+static uintptr_t led_cmd_codes[LED_CMD_COUNT];
+static uint8_t   led_cmd_code_lengths[LED_CMD_COUNT];
+
+/* Find the length of each command's codeword from a Huffman tree with
+ * LED_CMD_BASE branches per node. Ties always go to the lowest node, so
+ * every device builds the same tree. Returns the longest length. */
+static uint8_t led_cmd_code_tree(const uint16_t *weights) {
+    uint16_t node_weight[2 * LED_CMD_COUNT + LED_CMD_BASE];
+    uint16_t node_parent[2 * LED_CMD_COUNT + LED_CMD_BASE];
+    bool     node_active[2 * LED_CMD_COUNT + LED_CMD_BASE];
+    uint16_t nodes   = LED_CMD_COUNT;
+    uint16_t active  = 0;
+    uint8_t  longest = 0;
+
+    for (uint16_t i = 0; i < LED_CMD_COUNT; i++) {
+        node_weight[i] = weights[i];
+        node_active[i] = (weights[i] != 0);
+        active += node_active[i];
+        led_cmd_code_lengths[i] = 0;
+    }
+
+    /* A lone command still needs one symbol */
+    if (active == 1) {
+        for (uint16_t i = 0; i < LED_CMD_COUNT; i++) {
+            if (node_active[i]) {
+                led_cmd_code_lengths[i] = 1;
+            }
         }
+        return(1);
+    }
 
-        /* Only process the command if the current receive window
-         * hasn't been invalidated. */
-        if (cmd_window_state.valid_cmd) {
-            /* Set num lock and caps lock bits when each is toggled
-             * on and off within the receive window */
-            if (led_state.num_lock != num_lock_state) {
-                if ((led_state.caps_lock == caps_lock_state) &&
-                    (cmd_window_state.caps_lock_count == 0) &&
-                    (cmd_window_state.bit_count < LED_CMD_BITS)) {
-
-                    cmd_window_state.num_lock_count++;
-
-                    /* Move to the next bit if num lock was toggled twice */
-                    if (cmd_window_state.num_lock_count == 2) {
-                        cmd_window_state.raw_led_cmd =
-                            (cmd_window_state.raw_led_cmd << 1) + NUM_LOCK_BIT;
-
-                        cmd_window_state.num_lock_count = 0;
-                        cmd_window_state.bit_count++;
-                    }
-                } else {
-                    /* Cancel the receive window if num lock and
-                     * caps lock are inter-mixed */
-                    cmd_window_state.valid_cmd = false;
+    /* Pad with unused leaves so every node has all of its branches */
+    while ((active > 1) && (((active - 1) % (LED_CMD_BASE - 1)) != 0)) {
+        node_weight[nodes] = 0;
+        node_active[nodes] = true;
+        nodes++;
+        active++;
+    }
+
+    /* Merge the lightest nodes until only the root is left */
+    while (active > 1) {
+        node_weight[nodes] = 0;
+
+        for (uint8_t branch = 0; branch < LED_CMD_BASE; branch++) {
+            uint16_t lightest = nodes;
+
+            for (uint16_t i = 0; i < nodes; i++) {
+                if (node_active[i] &&
+                    ((lightest == nodes) || (node_weight[i] < node_weight[lightest]))) {
+                    lightest = i;
                 }
             }
 
-            if (led_state.caps_lock != caps_lock_state) {
-                if ((led_state.num_lock == num_lock_state) &&
-                    (cmd_window_state.num_lock_count == 0) &&
-                    (cmd_window_state.bit_count < LED_CMD_BITS)) {
+            node_active[lightest] = false;
+            node_parent[lightest] = nodes;
+            node_weight[nodes]   += node_weight[lightest];
+        }
 
-                    cmd_window_state.caps_lock_count++;
+        node_active[nodes] = true;
+        nodes++;
+        active -= LED_CMD_BASE - 1;
+    }
 
-                    /* Move to the next bit if caps lock was toggled twice */
-                    if (cmd_window_state.caps_lock_count == 2) {
-                        cmd_window_state.raw_led_cmd =
-                            (cmd_window_state.raw_led_cmd << 1) + CAPS_LOCK_BIT;
+    /* A command's codeword has one symbol per branch to the root */
+    for (uint16_t i = 0; i < LED_CMD_COUNT; i++) {
+        if (weights[i] != 0) {
+            for (uint16_t node = i; node != (nodes - 1); node = node_parent[node]) {
+                led_cmd_code_lengths[i]++;
+            }
 
-                        cmd_window_state.caps_lock_count = 0;
-                        cmd_window_state.bit_count++;
-                    }
-                } else {
-                    /* Cancel the receive window if num lock and
-                     * caps lock are inter-mixed */
-                    cmd_window_state.valid_cmd = false;
+            if (led_cmd_code_lengths[i] > longest) {
+                longest = led_cmd_code_lengths[i];
+            }
+        }
+    }
+
+    return(longest);
+}
+
+/* Build the prefix-free codeword for every command from led_cmd_weights,
+ * so the most common commands are sent with the fewest symbols. If any
+ * codeword would be longer than LED_CMD_MAX_SYMBOLS, the weights are
+ * evened out until they all fit. The codewords are then assigned in
+ * canonical order, so only their lengths depend on the tree. */
+static void led_cmd_build_codes(void) {
+    uint16_t  weights[LED_CMD_COUNT];
+    uintptr_t code   = 0;
+    uint8_t   length = 0;
+    bool      flattened = true;
+
+    for (uint16_t i = 0; i < LED_CMD_COUNT; i++) {
+        weights[i] = led_cmd_weights[i];
+    }
+
+    while ((led_cmd_code_tree(weights) > LED_CMD_MAX_SYMBOLS) && flattened) {
+        flattened = false;
+
+        for (uint16_t i = 0; i < LED_CMD_COUNT; i++) {
+            if (weights[i] > 1) {
+                weights[i] = (weights[i] + 1) / 2;
+                flattened  = true;
+            }
+        }
+    }
+
+    for (uint8_t symbols = 1; symbols <= LED_CMD_MAX_SYMBOLS; symbols++) {
+        for (uint16_t i = 0; i < LED_CMD_COUNT; i++) {
+            if (led_cmd_code_lengths[i] == symbols) {
+                /* Each codeword follows the previous one, extended with
+                 * zeros if it is longer */
+                if (length != 0) {
+                    code++;
                 }
+
+                for (; length < symbols; length++) {
+                    code *= LED_CMD_BASE;
+                }
+
+                led_cmd_codes[i] = code;
+
+                LED_LOG(LED_CMD_CODE, i, symbols);
             }
         }
+    }
+}
 
-        /* Process the command if complete */
-        if (cmd_window_state.bit_count == LED_CMD_BITS) {
-#           ifdef CONSOLE_ENABLE
-                uprintf("PROCESS_LED_CMD: %d\n", cmd_window_state.raw_led_cmd);
-#           endif
-            process_led_cmd(cmd_window_state.raw_led_cmd);
+/* By default, every command is equally likely. This can be overridden
+ * to give the most common commands shorter codes. */
+__attribute__ ((weak))
+const uint8_t led_cmd_weights[LED_CMD_COUNT] = { [0 ... LED_CMD_COUNT - 1] = 1 };
+#endif
 
-            /* Ignore any more LED signals during this receive window */
-            cmd_window_state.valid_cmd = false;
+#ifdef LED_CMD_ARGS
+/* By default, no command takes an argument */
+__attribute__ ((weak))
+const uint8_t led_cmd_arg_bits[LED_CMD_COUNT] = { 0 };
+#endif
+
+/* Get how many bits of argument follow a command */
+static uint8_t led_cmd_arg_size(uintptr_t opcode) {
+#   ifdef LED_CMD_ARGS
+    uint8_t bits = led_cmd_arg_bits[opcode];
+
+    return((bits > LED_ARG_BITS) ? LED_ARG_BITS : bits);
+#   else
+    return(0);
+#   endif
+}
+
+/* Get how many bits follow a command: its argument, then the sequence
+ * and check bits. */
+static uint8_t led_cmd_tail_size(uintptr_t opcode) {
+    return(led_cmd_arg_size(opcode) + LED_SEQ_BITS + LED_CHECK_BITS);
+}
+
+#if LED_CHECK_BITS > 0
+/* Get the CRC of the given number of bits, most significant bit
+ * first. Starting from all ones means a command of all zeroes doesn't
+ * have all zero check bits. */
+static uint8_t led_cmd_check(uintptr_t data, uint8_t bits) {
+    uint8_t mask = (1 << LED_CHECK_BITS) - 1;
+    uint8_t crc  = mask;
+
+    for (uint8_t i = bits; i > 0; i--) {
+        bool bit = ((data >> (i - 1)) ^ (crc >> (LED_CHECK_BITS - 1))) & 1;
+
+        crc = (crc << 1) & mask;
+
+        if (bit) {
+            crc ^= LED_CHECK_POLY;
         }
     }
 
-    /* Keep these copies of the LED states in sync with the host. */
-    num_lock_state  = led_state.num_lock;
-    caps_lock_state = led_state.caps_lock;
-    return true;
+    return(crc);
 }
 
-/* This closes the send window, triggered after a time set by
- * the sending function. */
-uint32_t close_send_window(uint32_t trigger_time, void *cb_arg) {
-#   ifdef CONSOLE_ENABLE
-    uprint("CLOSE_SEND_WINDOW\n");
+/* Get the check bits of a frame, which cover its address, its command
+ * and the argument and sequence bits that follow the command. */
+static uint8_t led_frame_check(uint8_t addr, uintptr_t opcode, uintptr_t tail) {
+    uint8_t bits = LED_CMD_BITS + led_cmd_tail_size(opcode) - LED_CHECK_BITS;
+
+    return(led_cmd_check(LED_CMD_WITH_ARG(opcode, tail) | ((uintptr_t)addr << bits), bits + LED_ADDR_BITS));
+}
+#endif
+
+/* Set the static state variables to match the host.
+ *
+ * This function should be called from keyboard_post_init_user. */
+void set_init_led_state(void) {
+    lock_state = led_cmd_locks(host_keyboard_led_state());
+
+#   ifdef LED_LOG_LOCKS
+    LED_LOG(LED_LOCKS, host_keyboard_led_state().raw);
+#   endif
+
+#   ifdef LED_CMD_HUFFMAN
+    led_cmd_build_codes();
+#   endif
+
+#   ifdef LED_CALIBRATE
+    led_cal_load();
+#   endif
+
+#   if defined(LED_CMD_STATS) && (LED_STATS_INTERVAL > 0)
+    defer_exec(LED_STATS_INTERVAL, led_stats_periodic, NULL);
+#   endif
+
+#   ifdef LED_CMD_RAW_HID
+    led_raw_ping();
 #   endif
-    in_cmd_snd_window = false;
-    return 0;
 }
 
-/* This is the primary function for sending the LED command. It loops
- * with deferred execution, either pushing or releasing a lock key
- * each time it is run. It also determines how long the next loop should
- * be deferred. */
-uint32_t async_send_led(uint32_t trigger_time, void *cb_arg) {
-    led_cmd_out *led_cmd_ptr = (led_cmd_out *)cb_arg;
-    uint32_t next_run_wait = 0;
-    uint8_t  keycode = 0;
+/* Reset the cmd_window_state struct to start receiving a new frame */
+static void led_rcv_restart(cmd_window_state_t *cmd_window_state) {
+    cmd_window_state->symbol_count = 0;
+    cmd_window_state->raw_led_cmd = 0;
+    cmd_window_state->pending_lock = 0;
+    cmd_window_state->state = LED_RCV_FRAME;
+    cmd_window_state->arg_start = 0;
+    cmd_window_state->addr = LED_ADDR_ALL;
+    cmd_window_state->addressed = false;
+}
 
-    /* Figure out which key is used and the delay on pressing it */
-    switch ((led_cmd_ptr->raw_led_cmd >> led_cmd_ptr->current_bit) & 1) {
-        case NUM_LOCK_BIT:
-            keycode = KC_NUM;
-            next_run_wait = LED_NUM_WAIT;
-            break;
+/* Give up on the frame being received, if there is one, and move the
+ * receive window to the given state. */
+static void led_rcv_drop(cmd_window_state_t *cmd_window_state, led_rcv_state_t state) {
+    if (cmd_window_state->state != LED_RCV_FRAME) {
+        return;
+    }
 
-        case CAPS_LOCK_BIT:
-            keycode = KC_CAPS;
-            next_run_wait = LED_CAPS_WAIT;
-            break;
+    led_rcv_count.drops++;
+    LED_STATS_COUNT(dropped);
+
+    LED_LOG(LED_RCV_DROPPED, led_rcv_count.drops);
+
+    cmd_window_state->state = state;
+}
+
+/* Close out the receive window and reset the cmd_window_state
+ * struct to known defaults. This function is designed to be
+ * deferred a certain time after the window opens. */
+uint32_t close_rcv_window(uint32_t trigger_time, void *cb_arg) {
+    cmd_window_state_t *cmd_window_state = (cmd_window_state_t *)cb_arg;
+
+    LED_LOG(CLOSE_RCV_WINDOW);
+
+    rcv_window_token = INVALID_DEFERRED_TOKEN;
+
+#   ifdef LED_CMD_ACK
+    /* Acknowledge the command now that its frame is over */
+    if (led_ack_pending) {
+        led_cmd_kick();
     }
+#   endif
 
-    /* If the key isn't pressed, just press it and keep the set delay */
-    if (!led_cmd_ptr->key_down) {
-        register_code(keycode);
-        led_cmd_ptr->key_down = true;
-    } else {
-        /* Otherwise, release the key and either get the next one ready
-         * or finish the sequence. */
-        next_run_wait = LED_BETWEEN_WAIT;
-        unregister_code(keycode);
-        led_cmd_ptr->key_down = false;
+    /* The conditional should not be required, but just in case... */
+    if (in_cmd_rec_window) {
+        in_cmd_rec_window = false;
+        LED_STATS_TIME(window_ms, led_stats_rcv_start);
 
-        if ((led_cmd_ptr->current_bit == 0) && (led_cmd_ptr->first_stage == false)) {
-            next_run_wait = 0;
-            defer_exec(LED_CMD_SELF_WAIT, close_send_window, NULL);
+        /* A frame that stopped part of the way through is lost */
+        if ((cmd_window_state->symbol_count != 0) || (cmd_window_state->pending_lock != 0)) {
+            if (cmd_window_state->state == LED_RCV_FRAME) {
+                led_rcv_count.timeouts++;
+            }
+            led_rcv_drop(cmd_window_state, LED_RCV_FRAME);
         }
 
-        if (led_cmd_ptr->first_stage == true) {
-            led_cmd_ptr->first_stage = false;
-        } else {
-            led_cmd_ptr->first_stage = true;
-            led_cmd_ptr->current_bit--;
-        }
+        led_rcv_restart(cmd_window_state);
     }
 
-    return(next_run_wait);
+    led_cmd_wake();
+    return 0;
 }
 
-/* This code initiates the LED sending processing. It is designed
- * for deferred execution, looping asynchronously until no other
- * commands are in process. */
-uint32_t start_led_cmd(uint32_t trigger_time, void *cb_arg) {
-    static led_cmd_out static_led_cmd = {
-        .current_bit = LED_CMD_BITS - 1,
-        .raw_led_cmd = 0,
-        .key_down = false,
-        .first_stage = true
-    };
+/* Check whether an LED change can open a receive window. With framing,
+ * every frame starts by toggling the lock for LED_FRAME_START_BIT on
+ * its own, so toggles of the other locks (such as turning caps lock on
+ * while typing) are ignored instead of holding a window open. */
+static bool led_frame_start(uint8_t changed) {
+#   ifdef LED_CMD_FRAMED
+    return(changed == (1 << LED_FRAME_START_BIT));
+#   else
+    return(true);
+#   endif
+}
 
-    if (in_cmd_rec_window || in_cmd_snd_window) {
-        /* Command already in progress, so wait for the next window */
-        return(LED_CMD_TIMEOUT);
-    } else {
-        /* No commands in process, so start this one */
-        in_cmd_snd_window = true;
-        static_led_cmd.raw_led_cmd = (uintptr_t) cb_arg;
-        static_led_cmd.current_bit = LED_CMD_BITS - 1;
-
-        /* Run the first send step immediately, then defer the next one
-         * the appropriate amount of time.
-         */
-        defer_exec(async_send_led(0, &static_led_cmd), async_send_led, &static_led_cmd);
-        return(0);
+#ifdef LED_RCV_RESYNC
+/* Received symbols are kept in case the decoder has to resync, marked
+ * when every lock was at rest before them, as only those can start a
+ * frame. */
+#define LED_RCV_AT_REST 0x80
+#endif
+
+/* Get the symbol for a lock that was toggled, given which locks were on
+ * before the symbol started. */
+static uint8_t led_rcv_toggled(cmd_window_state_t *cmd_window_state, uint8_t changed, uint8_t locks) {
+#   ifdef LED_RCV_RESYNC
+    if (locks == cmd_window_state->start_locks) {
+        return(__builtin_ctz(changed) | LED_RCV_AT_REST);
     }
+#   endif
+
+    return(__builtin_ctz(changed));
 }
 
-/* This function starts the LED command send process, and will
- * usually be called directly from macro code.
- *
- * If the start if deferred, the identifier for the deferred function
- * is returned. Otherwise, zero is returned. */
-uint32_t send_led_cmd(uintptr_t led_cmd) {
-#   ifdef CONSOLE_ENABLE
-    uprintf("SEND_LED_CMD: %d\n", led_cmd);
+/* Add a received symbol to the command. With framing, the first symbol
+ * must be the start symbol, which isn't part of the command. */
+static void led_rcv_symbol(cmd_window_state_t *cmd_window_state, uint8_t symbol) {
+#   ifdef LED_RCV_RESYNC
+    cmd_window_state->history[cmd_window_state->symbol_count] = symbol;
+    symbol &= ~LED_RCV_AT_REST;
+#   endif
+
+#   ifdef LED_CMD_FRAMED
+    if (cmd_window_state->symbol_count == 0) {
+        if (symbol != LED_FRAME_START_BIT) {
+            led_rcv_drop(cmd_window_state, LED_RCV_HUNT);
+        }
+
+        cmd_window_state->symbol_count++;
+        return;
+    }
 #   endif
 
-    /* Try to start it immediately, but start deferring it otherwise.
-     * This is slightly abusing the deferred execution function by
-     * passing it the LED command value directly instead of a pointer
-     * to the value. This allows the code to use deferred execution
-     * to handle remembering multiple future values, which means
-     * there doesn't need to be an array of values. However, it also
-     * means that the order that future commands are sent may not
-     * be the order that they were started. */
-    return(defer_exec(start_led_cmd(0, (void *) led_cmd), start_led_cmd, (void *) led_cmd));
+    cmd_window_state->raw_led_cmd = (cmd_window_state->raw_led_cmd * LED_CMD_BASE) + symbol;
+    cmd_window_state->symbol_count++;
+}
+
+/* Check whether the symbols received so far make up a whole command.
+ * With addressing, the address comes first, but a frame for another
+ * device is decoded the same way, as only its command and argument say
+ * where it ends. The address is checked once the frame is complete, so
+ * only the call to process_led_cmd is skipped. Fixed length commands are
+ * complete after LED_CMD_SYMBOLS, and variable length ones as soon as
+ * they match a codeword. A command that takes an argument or check bits
+ * is then complete once those have arrived. Any of these can also turn
+ * out to be corrupted, such as base-3 digits that spell a value that
+ * doesn't fit in its bits or a failed check, which drops the frame. */
+static bool led_rcv_complete(cmd_window_state_t *cmd_window_state, uintptr_t *led_cmd) {
+    uint8_t   symbols = cmd_window_state->symbol_count - LED_START_SYMBOLS;
+    uintptr_t opcode  = 0;
+
+    if (cmd_window_state->symbol_count <= LED_START_SYMBOLS) {
+        return(false);
+    }
+
+#   ifdef LED_CMD_ADDRESS
+    if (!cmd_window_state->addressed) {
+        if (symbols < LED_ADDR_SYMBOLS) {
+            return(false);
+        }
+
+        if ((cmd_window_state->raw_led_cmd >> LED_ADDR_BITS) != 0) {
+            led_rcv_drop(cmd_window_state, LED_RCV_DONE);
+            return(true);
+        }
+
+        cmd_window_state->addr = cmd_window_state->raw_led_cmd;
+        cmd_window_state->addressed = true;
+        cmd_window_state->raw_led_cmd = 0;
+        return(false);
+    }
+
+    symbols -= LED_ADDR_SYMBOLS;
+#   endif
+
+    if (cmd_window_state->arg_start != 0) {
+        uint8_t   bits = led_cmd_tail_size(cmd_window_state->led_cmd);
+        uintptr_t tail = cmd_window_state->raw_led_cmd >> LED_CHECK_BITS;
+
+        if ((cmd_window_state->symbol_count - cmd_window_state->arg_start) < LED_SYMBOLS(bits)) {
+            return(false);
+        }
+
+        if ((cmd_window_state->raw_led_cmd >> bits) != 0) {
+            led_rcv_drop(cmd_window_state, LED_RCV_DONE);
+            return(true);
+        }
+
+#       if LED_CHECK_BITS > 0
+        if ((cmd_window_state->raw_led_cmd & ((1 << LED_CHECK_BITS) - 1)) !=
+            led_frame_check(cmd_window_state->addr, cmd_window_state->led_cmd, tail)) {
+            LED_LOG(LED_CMD_CHECK_FAILED);
+            led_rcv_drop(cmd_window_state, LED_RCV_DONE);
+            return(true);
+        }
+#       endif
+
+#       ifdef LED_CMD_ACK
+        cmd_window_state->seq = tail & 1;
+        tail >>= 1;
+#       endif
+
+        *led_cmd = LED_CMD_TO(cmd_window_state->addr, LED_CMD_WITH_ARG(cmd_window_state->led_cmd, tail));
+        return(true);
+    }
+
+#   ifdef LED_CMD_HUFFMAN
+    for (opcode = 0; opcode < LED_CMD_COUNT; opcode++) {
+        if ((led_cmd_code_lengths[opcode] == symbols) &&
+            (led_cmd_codes[opcode] == cmd_window_state->raw_led_cmd)) {
+            break;
+        }
+    }
+
+    if (opcode == LED_CMD_COUNT) {
+        if (symbols < LED_CMD_MAX_SYMBOLS) {
+            return(false);
+        }
+
+        led_rcv_drop(cmd_window_state, LED_RCV_DONE);
+        return(true);
+    }
+#   else
+    if (symbols < LED_CMD_SYMBOLS) {
+        return(false);
+    }
+
+    if (cmd_window_state->raw_led_cmd > LED_CMD_MASK) {
+        led_rcv_drop(cmd_window_state, LED_RCV_DONE);
+        return(true);
+    }
+
+    opcode = cmd_window_state->raw_led_cmd;
+#   endif
+
+    /* Start on the argument, sequence and check bits, if there are any */
+    if (led_cmd_tail_size(opcode) != 0) {
+        cmd_window_state->led_cmd = opcode;
+        cmd_window_state->arg_start = cmd_window_state->symbol_count;
+        cmd_window_state->raw_led_cmd = 0;
+        return(false);
+    }
+
+    *led_cmd = LED_CMD_TO(cmd_window_state->addr, opcode);
+    return(true);
+}
+
+#if defined(LED_RCV_RESYNC) && (LED_CHECK_BITS > 0)
+/* Count a frame found again after losing track of one */
+static void led_rcv_resynced(void) {
+    led_rcv_count.resyncs++;
+
+    LED_LOG(LED_RCV_RESYNC, led_rcv_count.resyncs);
+}
+
+/* A frame that fails to decode may have started later than it seemed
+ * to, such as when the window opened partway through a frame, or after
+ * a lost toggle. Decode the symbols received so far again from each
+ * later one that could start a frame, and keep the first that still
+ * makes sense. The check bits weed out the rest. Returns true if the
+ * frame found is already complete. */
+static bool led_rcv_resync(cmd_window_state_t *cmd_window_state, uintptr_t *led_cmd) {
+    uint8_t  history[LED_FRAME_SYMBOLS];
+    uint8_t  count = cmd_window_state->symbol_count;
+    uint16_t drops = led_rcv_count.drops;
+
+    for (uint8_t i = 0; i < count; i++) {
+        history[i] = cmd_window_state->history[i];
+    }
+
+    for (uint8_t start = 1; start < count; start++) {
+        bool complete = false;
+
+        if (!(history[start] & LED_RCV_AT_REST)) {
+            continue;
+        }
+
+#       ifdef LED_CMD_FRAMED
+        if ((history[start] & ~LED_RCV_AT_REST) != LED_FRAME_START_BIT) {
+            continue;
+        }
+#       endif
+
+        led_rcv_restart(cmd_window_state);
+
+        for (uint8_t i = start; (i < count) && !complete; i++) {
+            led_rcv_symbol(cmd_window_state, history[i]);
+            complete = (cmd_window_state->state == LED_RCV_FRAME) &&
+                       led_rcv_complete(cmd_window_state, led_cmd);
+        }
+
+        /* Frames tried here that don't work out were never there, so
+         * they aren't counted as dropped */
+        led_rcv_count.drops = drops;
+
+        if (cmd_window_state->state == LED_RCV_FRAME) {
+            led_rcv_resynced();
+            return(complete);
+        }
+    }
+
+    cmd_window_state->symbol_count = 0;
+    cmd_window_state->state = LED_RCV_HUNT;
+    return(false);
+}
+#endif
+
+/* This is the function that tracks incoming commands and processes
+ * receiving them. It calls out to a (presumably) user-defined
+ * process_led_cmd function when a complete command is received.
+ *
+ * This function should be called from led_update_user. */
+bool led_update_cmd(led_t led_state) {
+    static cmd_window_state_t cmd_window_state = {
+      .symbol_count = 0,
+      .raw_led_cmd = 0,
+      .pending_lock = 0,
+      .state = LED_RCV_FRAME,
+      .arg_start = 0,
+      .addr = LED_ADDR_ALL,
+      .addressed = false
+    };
+
+    uint8_t   locks   = led_cmd_locks(led_state);
+    uint8_t   changed = locks ^ lock_state;
+    uintptr_t led_cmd = 0;
+
+    /* The send window may close on this change, but it is still the
+     * echo of our own command. */
+    bool sending = in_cmd_snd_window;
+
+#   ifdef LED_LOG_LOCKS
+    /* Every change is logged, so the trace can be replayed later */
+    if (changed != 0) {
+        LED_LOG(LED_LOCKS, led_state.raw);
+    }
+#   endif
+
+    if (sending) {
+        led_send_echo(locks);
+    }
+
+    /* Only process if not currently sending a command and an appropriate state changed */
+    if ((!sending) && (changed != 0) &&
+        (in_cmd_rec_window || led_frame_start(changed))) {
+
+        /* Open command window and start timer to it if we are not
+         * already in the middle of one. */
+        if (!in_cmd_rec_window) {
+            LED_LOG(OPEN_RCV_WINDOW);
+
+            in_cmd_rec_window = true;
+            cmd_window_state.start_locks = lock_state;
+#           ifdef LED_CMD_STATS
+            led_stats_rcv_start = timer_read32();
+#           endif
+            rcv_window_token = defer_exec(LED_TIMING(cmd_timeout, LED_CMD_TIMEOUT), close_rcv_window, &cmd_window_state);
+        }
+
+#       if defined(LED_RCV_RESYNC) && (LED_CHECK_BITS > 0)
+        /* After losing track of a frame, every lock being back where the
+         * window started is a frame boundary, so a change that can start
+         * a frame starts one there. */
+        if ((cmd_window_state.state == LED_RCV_HUNT) &&
+            (lock_state == cmd_window_state.start_locks) && led_frame_start(changed)) {
+            led_rcv_restart(&cmd_window_state);
+            led_rcv_resynced();
+        }
+#       endif
+
+        /* Only process the command if the current receive window
+         * hasn't lost track of the frame. If more than one lock changed
+         * at once, an LED report was missed and the symbol order is
+         * unknown, so drop the frame. */
+        if (cmd_window_state.state == LED_RCV_DONE) {
+            LED_STATS_COUNT(ignored);
+        }
+
+        if ((changed & (changed - 1)) != 0) {
+            led_rcv_drop(&cmd_window_state, LED_RCV_HUNT);
+        } else if ((cmd_window_state.state == LED_RCV_FRAME) &&
+                   (cmd_window_state.symbol_count < LED_FRAME_SYMBOLS)) {
+#           ifdef LED_EDGE_CODING
+            /* Every single toggle is a symbol */
+            led_rcv_symbol(&cmd_window_state, led_rcv_toggled(&cmd_window_state, changed, lock_state));
+#           else
+            /* A symbol is sent by toggling a lock on and off within the
+             * receive window. Drop the frame if the locks are
+             * inter-mixed. */
+            if (cmd_window_state.pending_lock == 0) {
+                cmd_window_state.pending_lock = changed;
+            } else if (cmd_window_state.pending_lock == changed) {
+                cmd_window_state.pending_lock = 0;
+                led_rcv_symbol(&cmd_window_state, led_rcv_toggled(&cmd_window_state, changed, locks));
+            } else {
+                led_rcv_drop(&cmd_window_state, LED_RCV_HUNT);
+            }
+#           endif
+        }
+
+        /* Process the command if complete */
+        if ((cmd_window_state.state == LED_RCV_FRAME) &&
+            led_rcv_complete(&cmd_window_state, &led_cmd)) {
+            bool valid = (cmd_window_state.state == LED_RCV_FRAME);
+
+#           if defined(LED_RCV_RESYNC) && (LED_CHECK_BITS > 0)
+            /* Look for a frame that started partway through the
+             * dropped one */
+            if (!valid) {
+                valid = led_rcv_resync(&cmd_window_state, &led_cmd);
+            }
+#           endif
+
+            /* Frames sent to other devices have been decoded in full,
+             * so the window closes at their end, but aren't processed */
+            if (valid && !led_cmd_addressed(LED_CMD_ADDR(led_cmd))) {
+                LED_LOG(LED_CMD_NOT_ADDRESSED, led_cmd);
+#               ifdef LED_CMD_ACK
+                led_ack_forget();
+#               endif
+            } else if (valid) {
+                LED_LOG(PROCESS_LED_CMD, led_cmd);
+                LED_STATS_COUNT(received);
+                LED_STATS_TIME(latency_ms, led_stats_rcv_start);
+#               ifdef LED_CMD_ACK
+                /* Every sender flips its own sequence bit, so the same
+                 * bit and command only mean a retry if nothing else was
+                 * sent in between and it arrives in time */
+                if ((cmd_window_state.seq == led_ack_last_seq) && (led_cmd == led_ack_last_cmd) &&
+                    (timer_elapsed32(led_ack_last_time) < LED_ACK_FORGET)) {
+                    /* The ack was lost, so ack again without repeating
+                     * the command */
+                    LED_LOG(LED_CMD_DUPLICATE);
+                    led_ack_pending = led_ack_last;
+                } else {
+                    led_ack_last_seq = cmd_window_state.seq;
+                    led_ack_last_cmd = led_cmd;
+                    led_ack_last     = process_led_cmd(led_cmd);
+                    led_ack_pending  = led_ack_last;
+                }
+                led_ack_last_time = timer_read32();
+#               else
+                process_led_cmd(led_cmd);
+#               endif
+            }
+
+            /* Ignore any more LED signals during this receive window */
+            if (valid) {
+                cmd_window_state.state = LED_RCV_DONE;
+            }
+        }
+
+#       ifdef LED_CMD_FRAMED
+        /* A frame ends once all of its symbols have arrived and every
+         * lock is back where it started, so close the window right away
+         * instead of waiting for the timeout. */
+        if ((cmd_window_state.state == LED_RCV_DONE) &&
+            (locks == cmd_window_state.start_locks)) {
+            cancel_deferred_exec(rcv_window_token);
+            close_rcv_window(0, &cmd_window_state);
+        }
+#       endif
+
+#       if defined(LED_CMD_ACK) || defined(LED_RCV_RESYNC)
+        /* A frame that was cut short never completes, so close the
+         * window once the locks go quiet instead of missing the retry or
+         * the next frame. */
+        if (in_cmd_rec_window) {
+            extend_deferred_exec(rcv_window_token, LED_TIMING(rcv_quiet, LED_RCV_QUIET));
+        }
+#       endif
+    }
+
+#   ifdef LED_CMD_ACK
+    /* Watch for the acknowledgement of the last command sent, which
+     * toggles LED_ACK_BIT and then toggles it back. It can arrive as
+     * soon as the echo of the last toggle shows the frame is over, even
+     * if the last key is still held. The next command waits until it
+     * is over. */
+    if ((led_ack_state != LED_ACK_IDLE) && (!in_cmd_rec_window) &&
+        (changed == (1 << LED_ACK_BIT)) &&
+        ((!sending) || (lock_state == sending_cmd->start_locks))) {
+        if (led_ack_state == LED_ACK_WAIT) {
+            LED_LOG(LED_CMD_ACK);
+            led_ack_state = LED_ACK_SEEN;
+            led_ack_retries = 0;
+            extend_deferred_exec(led_ack_token, LED_TIMING(ack_timeout, LED_ACK_TIMEOUT));
+        } else {
+            cancel_deferred_exec(led_ack_token);
+            led_ack_token = INVALID_DEFERRED_TOKEN;
+            led_ack_state = LED_ACK_IDLE;
+            led_cmd_kick();
+        }
+    }
+#   endif
+
+    /* Keep this copy of the LED states in sync with the host. */
+    lock_state = locks;
+    return true;
+}
+
+/* This closes the send window, triggered after a time set by
+ * the sending function. */
+uint32_t close_send_window(uint32_t trigger_time, void *cb_arg) {
+    LED_LOG(CLOSE_SEND_WINDOW);
+    send_window_token = INVALID_DEFERRED_TOKEN;
+    in_cmd_snd_window = false;
+    led_cmd_wake();
+    return 0;
+}
+
+/* Called once the last key of a command has been released. The send
+ * window stays open for LED_CMD_SELF_WAIT so that the echo of our own
+ * toggles isn't received as a command, and with echo clocking, for
+ * at least LED_ECHO_HOLD from the first press. With framing, the window
+ * closes as soon as that echo shows the end of the frame, which may
+ * already have happened. */
+static void led_cmd_sent(led_cmd_out *led_cmd_ptr) {
+    led_cmd_ptr->sent = true;
+    LED_STATS_TIME(send_ms, led_stats_send_start);
+
+#   ifdef LED_COLLISION_DETECT
+    if (!led_cmd_ptr->collided) {
+        led_collisions = 0;
+    }
+#   endif
+
+#   ifdef LED_CMD_FRAMED
+    if (lock_state == led_cmd_ptr->start_locks) {
+        close_send_window(0, NULL);
+        return;
+    }
+#   endif
+
+    uint32_t self_wait = LED_TIMING(self_wait, LED_CMD_SELF_WAIT);
+
+#   ifdef LED_ECHO_HOLD
+    uint32_t elapsed = timer_elapsed32(led_cmd_ptr->start_time);
+
+    if (elapsed + self_wait < LED_ECHO_HOLD) {
+        self_wait = LED_ECHO_HOLD - elapsed;
+    }
+#   endif
+
+    send_window_token = defer_exec(self_wait, close_send_window, NULL);
+}
+
+/* Set up a command and its argument to be sent */
+static void led_cmd_encode(led_cmd_out *led_cmd_ptr, uintptr_t led_cmd) {
+    uintptr_t opcode = LED_CMD_OPCODE(led_cmd);
+
+    led_cmd_ptr->led_cmd = led_cmd;
+
+#   ifdef LED_CMD_HUFFMAN
+    led_cmd_ptr->raw_led_cmd = led_cmd_codes[opcode];
+    led_cmd_ptr->cmd_symbols = led_cmd_code_lengths[opcode];
+#   else
+    led_cmd_ptr->raw_led_cmd = opcode;
+    led_cmd_ptr->cmd_symbols = LED_CMD_SYMBOLS;
+#   endif
+
+    led_cmd_ptr->raw_arg = LED_CMD_ARG(led_cmd) & (((uintptr_t)1 << led_cmd_arg_size(opcode)) - 1);
+    led_cmd_ptr->arg_symbols = LED_SYMBOLS(led_cmd_tail_size(opcode));
+
+#   ifdef LED_CMD_ACK
+    /* Retries, and commands sent again after a collision, are sent with
+     * the same sequence bit as the first try */
+    bool resend = (led_ack_retries > 0);
+
+#       ifdef LED_COLLISION_DETECT
+    resend = resend || led_ack_resend;
+    led_ack_resend = false;
+#       endif
+
+    if (!resend) {
+        led_ack_seq ^= 1;
+    }
+    led_cmd_ptr->raw_arg = (led_cmd_ptr->raw_arg << 1) | led_ack_seq;
+#   endif
+
+#   if LED_CHECK_BITS > 0
+    led_cmd_ptr->raw_arg = (led_cmd_ptr->raw_arg << LED_CHECK_BITS) |
+                           led_frame_check(LED_CMD_ADDR(led_cmd), opcode, led_cmd_ptr->raw_arg);
+#   endif
+
+#   ifdef LED_CMD_ADDRESS
+    /* The address digits go in front of the command's own */
+    uintptr_t addr = LED_CMD_ADDR(led_cmd);
+
+    for (uint8_t i = 0; i < led_cmd_ptr->cmd_symbols; i++) {
+        addr *= LED_CMD_BASE;
+    }
+
+    led_cmd_ptr->raw_led_cmd += addr;
+    led_cmd_ptr->cmd_symbols += LED_ADDR_SYMBOLS;
+#   endif
+
+    led_cmd_ptr->current_symbol = led_cmd_ptr->cmd_symbols + led_cmd_ptr->arg_symbols + LED_START_SYMBOLS - 1;
+    led_cmd_ptr->ack = false;
+}
+
+#ifdef LED_CMD_ACK
+/* Set up an acknowledgement to be sent. This is a single LED_ACK_BIT
+ * symbol with no start symbol, so it can't be taken for a command. */
+static void led_ack_encode(led_cmd_out *led_cmd_ptr) {
+    led_cmd_ptr->raw_led_cmd = LED_ACK_BIT;
+    led_cmd_ptr->cmd_symbols = 1;
+    led_cmd_ptr->raw_arg = 0;
+    led_cmd_ptr->arg_symbols = 0;
+    led_cmd_ptr->current_symbol = 0;
+    led_cmd_ptr->ack = true;
+}
+#endif
+
+/* Get the symbol that selects the lock key toggled next. Symbols are
+ * sent most significant first, after the start symbol when framed and
+ * followed by the argument, if any. The closing toggles after the last
+ * symbol with edge coding, or after a collision, restore whichever
+ * locks were left toggled, lowest symbol first. */
+static uint8_t led_cmd_symbol(led_cmd_out *led_cmd_ptr) {
+    uintptr_t digits = led_cmd_ptr->raw_arg;
+    uint8_t   symbol = led_cmd_ptr->current_symbol;
+
+    if (led_cmd_ptr->closing) {
+        return(__builtin_ctz(led_cmd_ptr->parity));
+    }
+
+#   ifdef LED_CMD_FRAMED
+    if (symbol == (led_cmd_ptr->cmd_symbols + led_cmd_ptr->arg_symbols)) {
+        return(LED_FRAME_START_BIT);
+    }
+#   endif
+
+    if (symbol >= led_cmd_ptr->arg_symbols) {
+        digits  = led_cmd_ptr->raw_led_cmd;
+        symbol -= led_cmd_ptr->arg_symbols;
+    }
+
+    for (uint8_t i = 0; i < symbol; i++) {
+        digits /= LED_CMD_BASE;
+    }
+
+    return(digits % LED_CMD_BASE);
+}
+
+#if defined(LED_CMD_ACK) || defined(LED_COLLISION_DETECT)
+/* Check whether pressing the key for a symbol makes the last toggle of
+ * the frame, which leaves every lock back where it started. */
+static bool led_cmd_last_toggle(led_cmd_out *led_cmd_ptr, uint8_t symbol) {
+    return((led_cmd_ptr->closing || (led_cmd_ptr->current_symbol == 0)) &&
+           ((led_cmd_ptr->parity ^ (1 << symbol)) == 0));
+}
+#endif
+
+/* Get the key that toggles the lock for a symbol, and how long it is
+ * held down. */
+static uint8_t led_lock_key(uint8_t symbol, uint32_t *wait) {
+    switch (symbol) {
+        case NUM_LOCK_BIT:
+            *wait = LED_TIMING(num_wait, LED_NUM_WAIT);
+            return(KC_NUM);
+
+        case CAPS_LOCK_BIT:
+            *wait = LED_TIMING(caps_wait, LED_CAPS_WAIT);
+            return(KC_CAPS);
+
+#       ifdef LED_SCROLL_LOCK_CODING
+        case SCROLL_LOCK_BIT:
+            *wait = LED_TIMING(scroll_wait, LED_SCROLL_WAIT);
+            return(KC_SCRL);
+#       endif
+    }
+
+    *wait = 0;
+    return(0);
+}
+
+/* This is the primary function for sending the LED command. It loops
+ * with deferred execution, either pushing or releasing a lock key
+ * each time it is run. It also determines how long the next loop should
+ * be deferred. */
+uint32_t async_send_led(uint32_t trigger_time, void *cb_arg) {
+    led_cmd_out *led_cmd_ptr = (led_cmd_out *)cb_arg;
+    uint8_t  symbol = led_cmd_symbol(led_cmd_ptr);
+    uint32_t next_run_wait = 0;
+
+    /* Figure out which key is used and the delay on pressing it */
+    uint8_t  keycode = led_lock_key(symbol, &next_run_wait);
+
+    /* If the key isn't pressed, just press it and keep the set delay */
+    if (!led_cmd_ptr->key_down) {
+        register_code(keycode);
+        led_cmd_ptr->key_down = true;
+        led_cmd_ptr->outstanding |= 1 << symbol;
+
+#       ifdef LED_CMD_ACK
+        /* Wait for the acknowledgement once the last toggle is out */
+        if (!led_cmd_ptr->ack && !led_cmd_ptr->collided &&
+            led_cmd_last_toggle(led_cmd_ptr, symbol)) {
+            led_ack_state = LED_ACK_WAIT;
+            led_ack_token = defer_exec(LED_TIMING(ack_timeout, LED_ACK_TIMEOUT) << led_ack_retries, led_ack_timeout, NULL);
+        }
+#       endif
+    } else {
+        /* Otherwise, release the key and either get the next one ready
+         * or finish the sequence. */
+        next_run_wait = LED_TIMING(between_wait, LED_BETWEEN_WAIT);
+        unregister_code(keycode);
+        led_cmd_ptr->key_down = false;
+
+        /* Track which locks have been left toggled */
+        led_cmd_ptr->parity ^= 1 << symbol;
+
+#       ifdef LED_COLLISION_DETECT
+        /* After a collision, only restore the locks */
+        if (led_cmd_ptr->collided) {
+            led_cmd_ptr->closing = true;
+        }
+#       endif
+
+#       ifdef LED_EDGE_CODING
+        /* Move on to the closing toggles after the last symbol */
+        if (!led_cmd_ptr->closing) {
+            if (led_cmd_ptr->current_symbol == 0) {
+                led_cmd_ptr->closing = true;
+            } else {
+                led_cmd_ptr->current_symbol--;
+            }
+        }
+#       else
+        /* Each symbol toggles its lock twice, so every lock is restored
+         * once the last symbol is done. */
+        if (!led_cmd_ptr->closing) {
+            if ((led_cmd_ptr->current_symbol == 0) && (led_cmd_ptr->first_stage == false)) {
+                led_cmd_ptr->closing = true;
+            }
+
+            if (led_cmd_ptr->first_stage == true) {
+                led_cmd_ptr->first_stage = false;
+            } else {
+                led_cmd_ptr->first_stage = true;
+                led_cmd_ptr->current_symbol--;
+            }
+        }
+#       endif
+
+        if (led_cmd_ptr->closing && (led_cmd_ptr->parity == 0)) {
+            next_run_wait = 0;
+            led_cmd_sent(led_cmd_ptr);
+        }
+    }
+
+    return(next_run_wait);
+}
+
+#ifdef LED_COLLISION_DETECT
+/* Get a random backoff after a collision. Each device waits at least
+ * its own number of LED_BACKOFF_WAITs, plus a random time whose range
+ * doubles with each collision in a row. */
+static uint32_t led_cmd_backoff(void) {
+    if (led_backoff_seed == 0) {
+        led_backoff_seed = (timer_read32() * 2654435761u) ^ (LED_DEVICE_ID + 1);
+    }
+
+    /* xorshift32 */
+    led_backoff_seed ^= led_backoff_seed << 13;
+    led_backoff_seed ^= led_backoff_seed >> 17;
+    led_backoff_seed ^= led_backoff_seed << 5;
+
+    uint32_t step = LED_TIMING(backoff_wait, LED_BACKOFF_WAIT);
+
+    return((step * (LED_DEVICE_ID + 1)) + (led_backoff_seed % (step << led_collisions)));
+}
+
+/* Called when the echo shows a lock change this device didn't make, so
+ * another device is sending at the same time and both frames are lost.
+ * Stop sending symbols, put back the locks this device toggled, and
+ * send the command again after a backoff. */
+static void led_cmd_collision(led_cmd_out *led_cmd_ptr) {
+    led_cmd_ptr->collided = true;
+
+    if (led_collisions < LED_COLLISION_RETRIES) {
+        LED_LOG(LED_CMD_COLLISION, led_cmd_ptr->led_cmd);
+        led_collisions++;
+
+#       ifdef LED_CMD_ACK
+        if (led_cmd_ptr->ack) {
+            led_ack_pending = true;
+        } else {
+            led_ack_resend = true;
+            led_cmd_requeue(led_cmd_ptr->led_cmd);
+        }
+#       else
+        led_cmd_requeue(led_cmd_ptr->led_cmd);
+#       endif
+    } else {
+        LED_LOG(LED_CMD_DROPPED, led_cmd_ptr->led_cmd);
+        led_collisions = 0;
+    }
+
+#   ifdef LED_CMD_ACK
+    /* The frame was cut short, so no acknowledgement will come */
+    if (led_ack_state == LED_ACK_WAIT) {
+        cancel_deferred_exec(led_ack_token);
+        led_ack_token = INVALID_DEFERRED_TOKEN;
+        led_ack_state = LED_ACK_IDLE;
+    }
+#   endif
+
+    cancel_deferred_exec(led_cmd_task_token);
+    led_cmd_task_token = defer_exec(led_cmd_backoff(), start_led_cmd, NULL);
+
+    /* Between key presses, go straight to restoring the locks */
+    if (!led_cmd_ptr->key_down) {
+        led_cmd_ptr->closing = true;
+
+        if (led_cmd_ptr->parity == 0) {
+            cancel_deferred_exec(led_cmd_ptr->token);
+            led_cmd_sent(led_cmd_ptr);
+        }
+    }
+}
+#endif
+
+#ifdef LED_CALIBRATE
+/* Get the check byte for a stored calibration */
+static uint8_t led_cal_check(led_cal_config_t config) {
+    return(0x5A ^ config.num_wait ^ config.caps_wait ^ config.scroll_wait);
+}
+
+/* Work out every timing from the calibrated waits. The slowest lock
+ * sets how long a symbol can take, and the receive timeout allows for
+ * another device taking twice as long. The timeouts for frames from
+ * other devices never drop below the ones in led_config.h, as the
+ * sender may not be calibrated, or may be on a slower host. */
+static void led_cal_apply(led_cal_config_t config) {
+    uint16_t slot = (config.num_wait > config.caps_wait) ? config.num_wait : config.caps_wait;
+
+#   ifdef LED_SCROLL_LOCK_CODING
+    if (config.scroll_wait > slot) {
+        slot = config.scroll_wait;
+    }
+#   endif
+
+    slot += led_timing.between_wait;
+
+    led_timing.num_wait     = config.num_wait;
+    led_timing.caps_wait    = config.caps_wait;
+    led_timing.scroll_wait  = config.scroll_wait;
+    led_timing.cmd_timeout  = LED_MAX((2 * slot * LED_CMD_TOGGLES) + 100, LED_CMD_TIMEOUT);
+    led_timing.self_wait    = (slot * LED_CMD_TOGGLES) + 200;
+    led_timing.rcv_quiet    = LED_MAX(slot + 50, LED_RCV_QUIET);
+    led_timing.ack_timeout  = LED_MAX(led_timing.rcv_quiet + 50, LED_TIMING_ACK);
+    led_timing.backoff_wait = slot;
+}
+
+/* Deferred to calibrate shortly after startup, once the host is
+ * reporting the LED state */
+static uint32_t led_cal_startup(uint32_t trigger_time, void *cb_arg) {
+    led_calibrate();
+    return 0;
+}
+
+/* Use the calibration stored in EEPROM, or calibrate after startup if
+ * there isn't one */
+static void led_cal_load(void) {
+    led_cal_config_t config = { .raw = eeconfig_read_user() };
+
+    if ((config.check == led_cal_check(config)) &&
+        (config.num_wait != 0) && (config.caps_wait != 0) && (config.scroll_wait != 0)) {
+        LED_LOG(LED_CAL_LOADED, config.num_wait, config.caps_wait);
+#       ifdef LED_SCROLL_LOCK_CODING
+        LED_LOG(LED_CAL_SCROLL, config.scroll_wait);
+#       endif
+        led_cal_apply(config);
+    } else {
+        defer_exec(LED_CAL_DELAY + (LED_DEVICE_ID * LED_CAL_STAGGER), led_cal_startup, NULL);
+    }
+}
+
+/* Get the wait for a lock from the longest echo it took, with the
+ * safety margin added */
+static uint8_t led_cal_wait(uint8_t symbol) {
+    uint32_t wait;
+
+    if (led_cal_longest[symbol] == LED_CAL_ON_RELEASE) {
+        led_lock_key(symbol, &wait);
+    } else {
+        wait = led_cal_longest[symbol] + ((uint32_t)led_cal_longest[symbol] * LED_CAL_MARGIN / 100) + 1;
+    }
+
+    return((wait > 255) ? 255 : wait);
+}
+
+/* Store and use the waits once every lock has been measured */
+static void led_cal_finish(void) {
+    led_cal_config_t config;
+
+    config.num_wait  = led_cal_wait(NUM_LOCK_BIT);
+    config.caps_wait = led_cal_wait(CAPS_LOCK_BIT);
+
+#   ifdef LED_SCROLL_LOCK_CODING
+    config.scroll_wait = led_cal_wait(SCROLL_LOCK_BIT);
+#   else
+    config.scroll_wait = config.num_wait;
+#   endif
+
+    config.check = led_cal_check(config);
+    eeconfig_update_user(config.raw);
+    led_cal_apply(config);
+    led_cal_active = false;
+
+    LED_LOG(LED_CAL_DONE, config.num_wait, config.caps_wait);
+#   ifdef LED_SCROLL_LOCK_CODING
+    LED_LOG(LED_CAL_SCROLL, config.scroll_wait);
+#   endif
+
+    close_send_window(0, NULL);
+}
+
+/* Deferred to press the key for the next sample and hold it for the
+ * current wait. If the echo hasn't come by then, the key is released,
+ * as some hosts only toggle a lock on release. If there is still no
+ * echo after LED_CAL_TIMEOUT, the host isn't echoing that lock, so the
+ * old timings are kept. */
+static uint32_t led_cal_step(uint32_t trigger_time, void *cb_arg) {
+    uint32_t wait;
+    uint8_t  keycode = led_lock_key(led_cal_symbol, &wait);
+
+    if (led_cal_key_down) {
+        unregister_code(keycode);
+        led_cal_key_down = false;
+        led_cal_released = true;
+        return(LED_CAL_TIMEOUT);
+    }
+
+    if (led_cal_released) {
+        LED_LOG(LED_CAL_FAILED, led_cal_symbol);
+        led_cal_released = false;
+        led_cal_active = false;
+        led_cal_token = INVALID_DEFERRED_TOKEN;
+        close_send_window(0, NULL);
+        return 0;
+    }
+
+    register_code(keycode);
+    led_cal_key_down = true;
+    led_cal_pressed = timer_read32();
+    return(wait);
+}
+
+/* Called with each echo while calibrating. The time from pressing the
+ * key to its echo is the round trip through the host, so the longest
+ * of these is the shortest safe wait for that lock. A lock that only
+ * toggles once the key is released keeps its current wait. Each lock
+ * is toggled LED_CAL_SAMPLES times, which leaves it where it started,
+ * moving on to the next lock after every toggle. Each lock then changes
+ * while the one before is still toggled, which receivers drop as mixed
+ * up symbols rather than taking for a frame. */
+static void led_cal_echo(uint8_t locks) {
+    uint32_t wait;
+    uint8_t  keycode = led_lock_key(led_cal_symbol, &wait);
+    uint16_t elapsed = timer_elapsed32(led_cal_pressed);
+
+    if (!((locks ^ lock_state) & (1 << led_cal_symbol))) {
+        return;
+    }
+
+    if (led_cal_key_down) {
+        unregister_code(keycode);
+        led_cal_key_down = false;
+
+        if (elapsed > led_cal_longest[led_cal_symbol]) {
+            led_cal_longest[led_cal_symbol] = elapsed;
+        }
+    } else if (led_cal_released) {
+        led_cal_released = false;
+        led_cal_longest[led_cal_symbol] = LED_CAL_ON_RELEASE;
+    } else {
+        return;
+    }
+
+    led_cal_sample++;
+    led_cal_symbol = led_cal_sample % LED_CMD_LOCKS;
+
+    if (led_cal_sample < (LED_CAL_SAMPLES * LED_CMD_LOCKS)) {
+        extend_deferred_exec(led_cal_token, LED_TIMING(between_wait, LED_BETWEEN_WAIT));
+        return;
+    }
+
+    cancel_deferred_exec(led_cal_token);
+    led_cal_token = INVALID_DEFERRED_TOKEN;
+    led_cal_finish();
+}
+
+/* Open the send window and start calibrating, so nothing else is sent
+ * and the echoes aren't taken for a command */
+static void led_cal_begin(void) {
+    LED_LOG(LED_CAL_START);
+
+    in_cmd_snd_window = true;
+    led_cal_active = true;
+    led_cal_symbol = 0;
+    led_cal_sample = 0;
+    led_cal_key_down = false;
+    led_cal_released = false;
+
+    for (uint8_t i = 0; i < LED_CMD_LOCKS; i++) {
+        led_cal_longest[i] = 0;
+    }
+
+    led_cal_token = defer_exec(led_cal_step(0, NULL), led_cal_step, NULL);
+}
+#endif
+
+/* The host reflects our own lock toggles back through led_update_user
+ * while a command is being sent.
+ *
+ * With echo clocking, as soon as the lock for the key being held has
+ * changed, release it and reschedule the next step, rather than
+ * waiting the full LED_NUM_WAIT or LED_CAPS_WAIT. That wait is only
+ * used as a timeout when the echo doesn't arrive.
+ *
+ * With collision detection, any lock change other than the echo of a
+ * toggle still waiting for one is another device sending, unless the
+ * last toggle of the frame is already out.
+ *
+ * With framing, the send window closes once the command has been sent
+ * and the echo shows every lock restored. */
+static void led_send_echo(uint8_t locks) {
+#   ifdef LED_CALIBRATE
+    if (led_cal_active) {
+        led_cal_echo(locks);
+        return;
+    }
+#   endif
+
+    if (sending_cmd == NULL) {
+        return;
+    }
+
+#   ifdef LED_COLLISION_DETECT
+    uint8_t changed = locks ^ lock_state;
+
+    if ((changed & ~sending_cmd->outstanding) && !sending_cmd->sent && !sending_cmd->collided &&
+        !(sending_cmd->key_down && led_cmd_last_toggle(sending_cmd, led_cmd_symbol(sending_cmd)))) {
+        led_cmd_collision(sending_cmd);
+    }
+
+    sending_cmd->outstanding &= ~changed;
+#   endif
+
+#   ifdef LED_ECHO_CLOCK
+    if (sending_cmd->key_down &&
+        ((locks ^ lock_state) & (1 << led_cmd_symbol(sending_cmd)))) {
+        uint32_t next_run_wait = async_send_led(timer_read32(), sending_cmd);
+
+        if (next_run_wait) {
+            extend_deferred_exec(sending_cmd->token, next_run_wait);
+        } else {
+            cancel_deferred_exec(sending_cmd->token);
+        }
+    }
+#   endif
+
+#   ifdef LED_CMD_FRAMED
+    if (sending_cmd->sent && in_cmd_snd_window &&
+        (locks == sending_cmd->start_locks)) {
+        cancel_deferred_exec(send_window_token);
+        close_send_window(0, NULL);
+    }
+#   endif
+}
+
+/* Open the send window and start sending a command. The first send
+ * step runs immediately, and the next one is deferred the appropriate
+ * amount of time. */
+static void led_cmd_begin(led_cmd_out *led_cmd_ptr) {
+    in_cmd_snd_window = true;
+    led_cmd_ptr->first_stage = true;
+    led_cmd_ptr->closing = false;
+    led_cmd_ptr->parity = 0;
+    led_cmd_ptr->sent = false;
+    led_cmd_ptr->outstanding = 0;
+    led_cmd_ptr->collided = false;
+    led_cmd_ptr->start_locks = lock_state;
+#   ifdef LED_ECHO_HOLD
+    led_cmd_ptr->start_time = timer_read32();
+#   endif
+    sending_cmd = led_cmd_ptr;
+
+    LED_STATS_COUNT(sent);
+#   ifdef LED_CMD_STATS
+    led_stats_send_start = timer_read32();
+#   endif
+
+    led_cmd_ptr->token = defer_exec(async_send_led(0, led_cmd_ptr),
+                                    async_send_led, led_cmd_ptr);
+}
+
+/* Start sending the command at the head of the queue. This is the
+ * single scheduler task for outgoing commands, deferred until no
+ * other command is in process, so commands go out in the order they
+ * were queued. It keeps running until the queue is empty. */
+uint32_t start_led_cmd(uint32_t trigger_time, void *cb_arg) {
+    static led_cmd_out static_led_cmd = {
+        .led_cmd = 0,
+        .current_symbol = LED_FRAME_SYMBOLS - 1,
+        .cmd_symbols = LED_CMD_MAX_SYMBOLS,
+        .arg_symbols = 0,
+        .raw_led_cmd = 0,
+        .raw_arg = 0,
+        .key_down = false,
+        .first_stage = true,
+        .closing = false,
+        .parity = 0,
+        .sent = false,
+        .outstanding = 0,
+        .collided = false,
+        .ack = false,
+        .token = INVALID_DEFERRED_TOKEN
+    };
+
+    led_cmd_waiting = false;
+
+    if (in_cmd_rec_window || in_cmd_snd_window) {
+        /* Command already in progress, so wait for its window to close.
+         * Polling is only a fallback in case a close is missed. */
+        led_cmd_waiting = true;
+        LED_STATS_COUNT(retries);
+        return(LED_TIMING(cmd_timeout, LED_CMD_TIMEOUT));
+    }
+
+#   ifdef LED_CALIBRATE
+    /* Calibration goes ahead of everything else */
+    if (led_cal_pending) {
+        led_cal_pending = false;
+        led_cal_begin();
+    } else
+#   endif
+#   ifdef LED_CMD_ACK
+    /* Acknowledgements go ahead of any queued commands, which wait
+     * until the last command sent has been acknowledged. */
+    if (led_ack_pending) {
+        led_ack_pending = false;
+        led_ack_encode(&static_led_cmd);
+        led_cmd_begin(&static_led_cmd);
+    } else if (led_ack_state != LED_ACK_IDLE) {
+        return(LED_TIMING(cmd_timeout, LED_CMD_TIMEOUT));
+    } else
+#   endif
+    if (led_cmd_queue_count > 0) {
+        /* No commands in process, so start the oldest one */
+        led_cmd_encode(&static_led_cmd, led_cmd_queue[led_cmd_queue_head]);
+        led_cmd_begin(&static_led_cmd);
+
+#       ifdef LED_CMD_ACK
+        led_ack_cmd = led_cmd_queue[led_cmd_queue_head];
+        led_ack_forget();
+#       endif
+
+        led_cmd_queue_head = (led_cmd_queue_head + 1) % LED_CMD_QUEUE_SIZE;
+        led_cmd_queue_count--;
+    }
+
+    if (led_cmd_queue_count == 0) {
+        led_cmd_task_token = INVALID_DEFERRED_TOKEN;
+        return(0);
+    }
+
+    led_cmd_waiting = true;
+    return(LED_TIMING(cmd_timeout, LED_CMD_TIMEOUT));
+}
+
+/* Queue a command to be sent with the locks. Before queueing, the
+ * command is checked against the most recently queued command that
+ * hasn't started yet, so commands that replace or undo it don't build
+ * up a backlog. If nothing else is in process, the command starts
+ * immediately. */
+static uint32_t led_cmd_enqueue(uintptr_t led_cmd) {
+    uint8_t tail = (led_cmd_queue_head + led_cmd_queue_count + LED_CMD_QUEUE_SIZE - 1) % LED_CMD_QUEUE_SIZE;
+    led_cmd_coalesce_t action = LED_CMD_KEEP;
+
+#   ifdef LED_CMD_HUFFMAN
+    /* Commands with a weight of zero have no codeword */
+    if (led_cmd_code_lengths[LED_CMD_OPCODE(led_cmd)] == 0) {
+        LED_LOG(LED_CMD_NO_CODE);
+        return(led_cmd_task_token);
+    }
+#   endif
+
+    if (led_cmd_queue_count > 0) {
+        action = coalesce_led_cmd(led_cmd_queue[tail], led_cmd);
+    }
+
+    switch (action) {
+        case LED_CMD_REPLACE:
+            LED_LOG(LED_CMD_REPLACED, led_cmd_queue[tail]);
+            led_cmd_queue[tail] = led_cmd;
+            break;
+
+        case LED_CMD_CANCEL:
+            LED_LOG(LED_CMD_CANCELLED, led_cmd_queue[tail]);
+            led_cmd_queue_count--;
+            break;
+
+        default:
+            if (led_cmd_queue_count == LED_CMD_QUEUE_SIZE) {
+                LED_LOG(LED_CMD_QUEUE_FULL);
+                return(led_cmd_task_token);
+            }
+
+            led_cmd_queue[(led_cmd_queue_head + led_cmd_queue_count) % LED_CMD_QUEUE_SIZE] = led_cmd;
+            led_cmd_queue_count++;
+            break;
+    }
+
+    /* Try to start it immediately, and start the scheduler task
+     * otherwise. Only one scheduler task is ever deferred. */
+    if (led_cmd_task_token == INVALID_DEFERRED_TOKEN) {
+        led_cmd_task_token = defer_exec(start_led_cmd(0, NULL), start_led_cmd, NULL);
+    }
+
+    return(led_cmd_task_token);
+}
+
+#ifdef LED_CMD_RAW_HID
+static void led_raw_send(led_raw_type_t type, uint8_t seq, uintptr_t led_cmd) {
+    uint8_t data[LED_RAW_SIZE] = { 0 };
+
+    data[LED_RAW_MAGIC_AT] = LED_RAW_MAGIC;
+    data[LED_RAW_TYPE_AT]  = type;
+    data[LED_RAW_SEQ_AT]   = seq;
+#   ifdef LED_DEVICE_ID
+    data[LED_RAW_FROM_AT]  = LED_DEVICE_ID;
+#   endif
+
+    for (uint8_t i = 0; i < 4; i++) {
+        data[LED_RAW_CMD_AT + i] = (uint8_t)(led_cmd >> (8 * i));
+    }
+
+    raw_hid_send(data, LED_RAW_SIZE);
+}
+
+/* Ask whether the relay is running, at most every LED_RAW_PING_WAIT.
+ * Until it answers, commands are sent with the locks. */
+static void led_raw_ping(void) {
+    if (!led_raw_pinged || (timer_elapsed32(led_raw_ping_time) >= LED_RAW_PING_WAIT)) {
+        led_raw_pinged    = true;
+        led_raw_ping_time = timer_read32();
+        led_raw_send(LED_RAW_PING, 0, 0);
+    }
+}
+
+/* Check that no command is queued for the locks or still being sent
+ * with them. Only then can a command go through the relay without
+ * overtaking one sent earlier. */
+static bool led_raw_locks_idle(void) {
+#   ifdef LED_CMD_ACK
+    /* A command waiting for its acknowledgement may still be retried */
+    if (led_ack_state != LED_ACK_IDLE) {
+        return(false);
+    }
+#   endif
+
+    return((led_cmd_queue_count == 0) && !in_cmd_snd_window);
+}
+
+/* Take a command out of the queue for the locks, if it hasn't started
+ * yet. If it already went out, a later copy of the same command is
+ * taken instead, so it still takes effect the right number of times. */
+static void led_raw_unqueue(uintptr_t led_cmd) {
+    for (uint8_t i = 0; i < led_cmd_queue_count; i++) {
+        if (led_cmd_queue[(led_cmd_queue_head + i) % LED_CMD_QUEUE_SIZE] != led_cmd) {
+            continue;
+        }
+
+        led_cmd_queue_count--;
+
+        for (uint8_t j = i; j < led_cmd_queue_count; j++) {
+            led_cmd_queue[(led_cmd_queue_head + j) % LED_CMD_QUEUE_SIZE] =
+                led_cmd_queue[(led_cmd_queue_head + j + 1) % LED_CMD_QUEUE_SIZE];
+        }
+        return;
+    }
+}
+
+/* Deferred to give up on the relay when the oldest command hasn't been
+ * acknowledged in time. Every command it still holds is sent again
+ * with the locks, in order. They are kept, so one the relay turns out
+ * to have passed on after all can be taken back out of the queue when
+ * its acknowledgement arrives. */
+static uint32_t led_raw_timeout(uint32_t trigger_time, void *cb_arg) {
+    led_raw_token = INVALID_DEFERRED_TOKEN;
+    led_raw_relay = false;
+    led_raw_fallback = true;
+    LED_LOG(LED_RAW_RELAY, 0);
+
+    for (uint8_t i = 0; i < led_raw_pending_count; i++) {
+        LED_LOG(LED_RAW_FALLBACK, led_raw_pending[i]);
+        led_cmd_enqueue(led_raw_pending[i]);
+    }
+
+    return(0);
+}
+
+/* Send a command through the relay, if it is running, isn't too far
+ * behind and nothing is waiting to go with the locks. Returns false if
+ * it needs to go with the locks instead. */
+static bool led_raw_send_cmd(uintptr_t led_cmd) {
+    if (!led_raw_relay) {
+        led_raw_ping();
+        return(false);
+    }
+
+    if (!led_raw_locks_idle()) {
+        return(false);
+    }
+
+    /* Anything that fell back has been sent with the locks by now */
+    if (led_raw_fallback) {
+        led_raw_fallback = false;
+        led_raw_pending_count = 0;
+    }
+
+    if (led_raw_pending_count == LED_CMD_QUEUE_SIZE) {
+        return(false);
+    }
+
+    led_raw_seq++;
+    led_raw_pending[led_raw_pending_count]     = led_cmd;
+    led_raw_pending_seq[led_raw_pending_count] = led_raw_seq;
+    led_raw_pending_count++;
+
+    LED_LOG(LED_RAW_SENT, led_cmd);
+    LED_STATS_COUNT(sent);
+    led_raw_send(LED_RAW_CMD, led_raw_seq, led_cmd);
+
+    if (led_raw_token == INVALID_DEFERRED_TOKEN) {
+        led_raw_token = defer_exec(LED_RAW_ACK_WAIT, led_raw_timeout, NULL);
+    }
+
+    return(true);
+}
+
+/* Forget a command the relay has acknowledged, or take it back out of
+ * the queue for the locks if it already fell back. The timeout starts
+ * again for the next one still waiting. */
+static void led_raw_acked(uint8_t seq) {
+    for (uint8_t i = 0; i < led_raw_pending_count; i++) {
+        if (led_raw_pending_seq[i] == seq) {
+            if (led_raw_fallback) {
+                led_raw_unqueue(led_raw_pending[i]);
+            }
+
+            led_raw_pending_count--;
+
+            for (uint8_t j = i; j < led_raw_pending_count; j++) {
+                led_raw_pending[j]     = led_raw_pending[j + 1];
+                led_raw_pending_seq[j] = led_raw_pending_seq[j + 1];
+            }
+            break;
+        }
+    }
+
+    if (led_raw_fallback) {
+        return;
+    }
+
+    if (led_raw_pending_count == 0) {
+        cancel_deferred_exec(led_raw_token);
+        led_raw_token = INVALID_DEFERRED_TOKEN;
+    } else {
+        extend_deferred_exec(led_raw_token, LED_RAW_ACK_WAIT);
+    }
+}
+
+/* Handle a raw HID report, which should be passed on from
+ * raw_hid_receive. Any report from the relay shows that it is running,
+ * and commands it passes on from other devices are processed just like
+ * those received with the locks. Returns false if the report isn't
+ * from the relay, so the keymap can handle it itself. */
+bool led_raw_receive(uint8_t *data, uint8_t length) {
+    if ((length < LED_RAW_CMD_AT + 4) || (data[LED_RAW_MAGIC_AT] != LED_RAW_MAGIC)) {
+        return(false);
+    }
+
+    if (!led_raw_relay) {
+        led_raw_relay = true;
+        LED_LOG(LED_RAW_RELAY, 1);
+    }
+
+    switch (data[LED_RAW_TYPE_AT]) {
+        case LED_RAW_CMD: {
+            uintptr_t led_cmd = 0;
+
+            for (uint8_t i = 0; i < 4; i++) {
+                led_cmd |= (uintptr_t)data[LED_RAW_CMD_AT + i] << (8 * i);
+            }
+
+            LED_LOG(LED_RAW_RECEIVED, led_cmd);
+
+            if (!led_cmd_addressed(LED_CMD_ADDR(led_cmd))) {
+                LED_LOG(LED_CMD_NOT_ADDRESSED, led_cmd);
+            } else {
+                LED_LOG(PROCESS_LED_CMD, led_cmd);
+                LED_STATS_COUNT(received);
+                process_led_cmd(led_cmd);
+            }
+            break;
+        }
+
+        case LED_RAW_ACK:
+            led_raw_acked(data[LED_RAW_SEQ_AT]);
+            break;
+    }
+
+    return(true);
+}
+#endif
+
+/* This function sends an LED command, and will usually be called
+ * directly from macro code.
+ *
+ * With LED_CMD_RAW_HID, the command goes through the relay whenever it
+ * is running. Otherwise, it is queued to be sent with the locks.
+ *
+ * If the start is deferred, the identifier for the deferred scheduler
+ * task is returned. Otherwise, zero is returned. */
+uint32_t send_led_cmd(uintptr_t led_cmd) {
+    LED_LOG(SEND_LED_CMD, led_cmd);
+
+#   ifdef LED_CMD_RAW_HID
+    if (led_raw_send_cmd(led_cmd)) {
+        return(INVALID_DEFERRED_TOKEN);
+    }
+#   endif
+
+    return(led_cmd_enqueue(led_cmd));
+}
+
+/* By default, every queued command is sent. This can be overridden to
+ * merge a new command with the most recently queued one that hasn't
+ * started sending yet. Return LED_CMD_REPLACE if only the new command
+ * needs to be sent, or LED_CMD_CANCEL if the new command undoes the
+ * queued one so that neither needs to be sent. */
+__attribute__ ((weak))
+led_cmd_coalesce_t coalesce_led_cmd(uintptr_t queued_cmd, uintptr_t led_cmd) {
+    return LED_CMD_KEEP;
+}
+
+/* Get the timings in use */
+led_timing_t led_cmd_timing(void) {
+#   ifdef LED_CALIBRATE
+    return(led_timing);
+#   else
+    led_timing_t timing = LED_TIMING_DEFAULT;
+
+    return(timing);
+#   endif
+}
+
+/* Get how many symbols a command is sent with, counting its start
+ * symbol, address, argument and check bits, or zero if it has no code.
+ * LED_FRAME_LATENCY and the other timing model macros give how long a
+ * frame of that many symbols takes. */
+uint8_t led_cmd_frame_symbols(uintptr_t led_cmd) {
+    uintptr_t opcode = LED_CMD_OPCODE(led_cmd);
+
+#   ifdef LED_CMD_HUFFMAN
+    uint8_t cmd_symbols = led_cmd_code_lengths[opcode];
+
+    if (cmd_symbols == 0) {
+        return(0);
+    }
+#   else
+    uint8_t cmd_symbols = LED_CMD_SYMBOLS;
+#   endif
+
+    return(LED_START_SYMBOLS + LED_ADDR_SYMBOLS + cmd_symbols + LED_SYMBOLS(led_cmd_tail_size(opcode)));
+}
+
+#ifdef LED_CALIBRATE
+/* Measure the timings for this host and store them in EEPROM. This
+ * runs as soon as the channel is free, and takes a few round trips
+ * through the host for each lock. Other devices see the toggles, but
+ * drop them, as the locks are toggled in turn so they overlap. */
+void led_calibrate(void) {
+    led_cal_pending = true;
+
+    if (led_cmd_task_token == INVALID_DEFERRED_TOKEN) {
+        led_cmd_task_token = defer_exec(start_led_cmd(0, NULL), start_led_cmd, NULL);
+    }
+}
+#endif
+
+/* Get how often the receiver has found a frame again after losing
+ * track of one, and how many frames it lost part of the way through. */
+led_rcv_counts_t led_rcv_counts(void) {
+    return(led_rcv_count);
+}
+
+#ifdef LED_CMD_LOG
+/* Deferred to print the event log in compact form, a few events at a
+ * time. Nothing is printed while a command is being sent or received,
+ * so the console doesn't hold up the lock timing. Events that didn't
+ * fit in the log are counted and reported once it is empty. */
+static uint32_t led_log_drain(uint32_t trigger_time, void *cb_arg) {
+    if (in_cmd_rec_window || in_cmd_snd_window) {
+        return(LED_LOG_DRAIN);
+    }
+
+    for (uint8_t i = 0; (i < LED_LOG_BATCH) && (led_log_count > 0); i++) {
+        led_log_entry_t *entry = &led_log_ring[led_log_head];
+
+        uprintf("LED_LOG %x %x %x %x\n", entry->event, entry->time, entry->arg0, entry->arg1);
+        led_log_head = (led_log_head + 1) % LED_LOG_SIZE;
+        led_log_count--;
+    }
+
+    if (led_log_count > 0) {
+        return(LED_LOG_DRAIN);
+    }
+
+    if (led_log_lost > 0) {
+        uprintf("LED_LOG %x %x %x 0\n", LOG_LED_LOG_LOST, (uint16_t)timer_read32(), led_log_lost);
+        led_log_lost = 0;
+    }
+
+    led_log_token = INVALID_DEFERRED_TOKEN;
+    return 0;
+}
+
+/* Add an event to the log. This only copies the event and its
+ * arguments, so it can be called while sending or receiving a command.
+ * Keymaps can log their own events, numbered from LED_LOG_USER. */
+void led_log(uint8_t event, uint16_t arg0, uint16_t arg1) {
+    if (led_log_count == LED_LOG_SIZE) {
+        if (led_log_lost < UINT16_MAX) {
+            led_log_lost++;
+        }
+        return;
+    }
+
+    led_log_entry_t *entry = &led_log_ring[(led_log_head + led_log_count) % LED_LOG_SIZE];
+
+    entry->time  = timer_read32();
+    entry->event = event;
+    entry->arg0  = arg0;
+    entry->arg1  = arg1;
+    led_log_count++;
+
+    if (led_log_token == INVALID_DEFERRED_TOKEN) {
+        led_log_token = defer_exec(LED_LOG_DRAIN, led_log_drain, NULL);
+    }
+}
+#endif
+
+#ifdef LED_CMD_STATS
+led_cmd_stats_t led_cmd_stats(void) {
+    return(led_stats);
+}
+
+void led_cmd_stats_reset(void) {
+    led_stats = (led_cmd_stats_t){ 0 };
+}
+
+#   ifdef CONSOLE_ENABLE
+static void led_stats_print(const char *name, const led_stats_histogram_t *histogram) {
+    const uint16_t *counts = histogram->counts;
+
+    uprintf("LED_STATS %s max %u: %u %u %u %u %u %u %u %u\n", name, histogram->max,
+            counts[0], counts[1], counts[2], counts[3],
+            counts[4], counts[5], counts[6], counts[7]);
+}
+#   endif
+
+/* Print the statistics to the console. Each histogram is printed as
+ * its longest time and then the count in each bucket. */
+void led_cmd_stats_dump(void) {
+#   ifdef CONSOLE_ENABLE
+    uprintf("LED_STATS sent %u received %u dropped %u resyncs %u ignored %u retries %u\n",
+            led_stats.sent, led_stats.received, led_stats.dropped,
+            led_rcv_count.resyncs, led_stats.ignored, led_stats.retries);
+    led_stats_print("send", &led_stats.send_ms);
+    led_stats_print("window", &led_stats.window_ms);
+    led_stats_print("latency", &led_stats.latency_ms);
+#   endif
+}
+#endif
+
+/* With LED_CMD_ADDRESS, commands sent to an address this returns false
+ * for are received but never processed. By default, a device only
+ * takes commands sent to every device. */
+__attribute__ ((weak))
+bool led_cmd_addressed(uint8_t addr) {
+    return(addr == LED_ADDR_ALL);
 }
 
 /* If no commands need to be processed by a given device (commands
  * are only sent, not received), then this default handler will
  * just ignore all completed commands.
  *
- * Return value for this function is currently ignored. */
+ * With LED_CMD_ACK, returning true acknowledges the command. Only one
+ * device should acknowledge each command. Otherwise, the return value
+ * is ignored. */
 __attribute__ ((weak))
 bool process_led_cmd(uintptr_t led_cmd) {
     return false;
@@ -27,6 +27,18 @@
 
 #define NUM_LOCK_BIT (1 - CAPS_LOCK_BIT)
 
+/* Scroll lock is only used with LED_SCROLL_LOCK_CODING, where it sends
+ * the third symbol of each base-3 digit. */
+#define SCROLL_LOCK_BIT 2
+
+#ifdef LED_SCROLL_LOCK_CODING
+#define LED_CMD_BASE  3
+#define LED_CMD_LOCKS 3
+#else
+#define LED_CMD_BASE  2
+#define LED_CMD_LOCKS 2
+#endif
+
 #ifndef LED_NUM_WAIT
 #define LED_NUM_WAIT (TAP_CODE_DELAY ? TAP_CODE_DELAY : 1)
 #endif
@@ -35,20 +47,566 @@
 #define LED_CAPS_WAIT (TAP_HOLD_CAPS_DELAY ? TAP_HOLD_CAPS_DELAY : 1)
 #endif
 
+#ifndef LED_SCROLL_WAIT
+#define LED_SCROLL_WAIT LED_NUM_WAIT
+#endif
+
 #ifndef LED_BETWEEN_WAIT
 #define LED_BETWEEN_WAIT 1
 #endif
 
+/* The longest any lock key is held, and so the longest one toggle can
+ * take before the next key is pressed. Every other timing is worked
+ * out from these. */
+#define LED_MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+#ifdef LED_SCROLL_LOCK_CODING
+#define LED_LOCK_WAIT LED_MAX(LED_MAX(LED_NUM_WAIT, LED_CAPS_WAIT), LED_SCROLL_WAIT)
+#else
+#define LED_LOCK_WAIT LED_MAX(LED_NUM_WAIT, LED_CAPS_WAIT)
+#endif
+
+#define LED_TOGGLE_TIME (LED_LOCK_WAIT + LED_BETWEEN_WAIT)
+
 #ifndef LED_CMD_BITS
 #define LED_CMD_BITS 3
 #endif
 
+/* Scroll lock doesn't affect typing, so it starts frames when it is
+ * available. */
+#ifndef LED_FRAME_START_BIT
+#   ifdef LED_SCROLL_LOCK_CODING
+#   define LED_FRAME_START_BIT SCROLL_LOCK_BIT
+#   else
+#   define LED_FRAME_START_BIT NUM_LOCK_BIT
+#   endif
+#endif
+
+/* Each symbol is one bit, or one base-3 digit with scroll lock coding.
+ * log3(2) is just over 0.63, so this rounds up to the fewest digits
+ * that hold the given number of bits. */
+#ifdef LED_SCROLL_LOCK_CODING
+#define LED_SYMBOLS(bits) (((bits) * 631 + 999) / 1000)
+#else
+#define LED_SYMBOLS(bits) (bits)
+#endif
+
+#define LED_CMD_SYMBOLS LED_SYMBOLS(LED_CMD_BITS)
+
+/* Check bits are a CRC of the command and its argument, so a frame
+ * that was received wrongly can be detected. A single check bit is
+ * plain parity. The default polynomials are the usual ones for each
+ * width, leaving out the top bit. */
+#ifndef LED_CHECK_BITS
+#define LED_CHECK_BITS 0
+#endif
+
+#ifndef LED_CHECK_POLY
+#   if LED_CHECK_BITS == 1
+#   define LED_CHECK_POLY 0x01
+#   elif LED_CHECK_BITS == 5
+#   define LED_CHECK_POLY 0x05
+#   elif LED_CHECK_BITS == 7
+#   define LED_CHECK_POLY 0x09
+#   elif LED_CHECK_BITS == 8
+#   define LED_CHECK_POLY 0x07
+#   else
+#   define LED_CHECK_POLY 0x03
+#   endif
+#endif
+
+#if LED_CHECK_BITS > 8
+#error "LED_CHECK_BITS can be at most 8"
+#endif
+
+/* With acknowledgements, a sequence bit flips for each new command but
+ * not when one is sent again, so receivers can ignore copies of a
+ * command they already processed. */
+#ifdef LED_CMD_ACK
+#define LED_SEQ_BITS 1
+#else
+#define LED_SEQ_BITS 0
+#endif
+
+/* With arguments, some commands are followed by a fixed length
+ * argument of up to LED_ARG_BITS bits. The sequence and check bits come
+ * after the argument and are sent with it as one field. */
+#ifdef LED_CMD_ARGS
+#   ifndef LED_ARG_BITS
+#   define LED_ARG_BITS 4
+#   endif
+#define LED_ARG_SYMBOLS LED_SYMBOLS(LED_ARG_BITS + LED_SEQ_BITS + LED_CHECK_BITS)
+#else
+#define LED_ARG_SYMBOLS LED_SYMBOLS(LED_SEQ_BITS + LED_CHECK_BITS)
+#endif
+
+#define LED_CMD_COUNT (1 << LED_CMD_BITS)
+#define LED_CMD_MASK  (((uintptr_t)1 << LED_CMD_BITS) - 1)
+
+/* Check the command table from led_enum.h, where it has been included.
+ * The codes are unique if adding up a bit for each one gives the same
+ * result as combining them. */
+#ifdef LED_CMD_TABLE
+#define LED_CMD_CHECK_CODE(name, code, weight, arg_bits) \
+    _Static_assert(((code) >= 0) && ((code) < LED_CMD_COUNT), #name " doesn't fit in LED_CMD_BITS");
+#define LED_CMD_CODE_SUM(name, code, weight, arg_bits) + (1ULL << (code))
+#define LED_CMD_CODE_OR(name, code, weight, arg_bits)  | (1ULL << (code))
+
+LED_CMD_TABLE(LED_CMD_CHECK_CODE)
+_Static_assert((0 LED_CMD_TABLE(LED_CMD_CODE_SUM)) == (0 LED_CMD_TABLE(LED_CMD_CODE_OR)),
+               "Two commands in LED_CMD_TABLE have the same code");
+
+#   ifdef LED_CMD_ARGS
+#   define LED_CMD_CHECK_ARG(name, code, weight, arg_bits) \
+    _Static_assert((arg_bits) <= LED_ARG_BITS, #name " has more argument bits than LED_ARG_BITS");
+LED_CMD_TABLE(LED_CMD_CHECK_ARG)
+#   endif
+#endif
+
+/* With variable length codes, rare commands can take more symbols than
+ * a fixed length command would. */
+#ifdef LED_CMD_HUFFMAN
+#   ifndef LED_CMD_MAX_SYMBOLS
+#   define LED_CMD_MAX_SYMBOLS (2 * LED_CMD_SYMBOLS)
+#   endif
+#   if LED_CMD_MAX_SYMBOLS < LED_CMD_SYMBOLS
+#   error "LED_CMD_MAX_SYMBOLS is too small to give every command a code"
+#   endif
+#else
+#define LED_CMD_MAX_SYMBOLS LED_CMD_SYMBOLS
+#endif
+
+/* With framing, every command is sent after a fixed start symbol, so a
+ * frame is one symbol longer than the command itself. */
+#ifdef LED_CMD_FRAMED
+#define LED_START_SYMBOLS 1
+#else
+#define LED_START_SYMBOLS 0
+#endif
+
+/* With addressing, every frame names the devices it is for right after
+ * the start symbol, so the others can ignore it. Address LED_ADDR_ALL
+ * is for every device, and is what commands without one are sent to. */
+#define LED_ADDR_ALL 0
+
+#ifdef LED_CMD_ADDRESS
+#   ifndef LED_ADDR_BITS
+#   define LED_ADDR_BITS 3
+#   endif
+#define LED_ADDR_SYMBOLS LED_SYMBOLS(LED_ADDR_BITS)
+#else
+#define LED_ADDR_BITS    0
+#define LED_ADDR_SYMBOLS 0
+#endif
+
+#define LED_FRAME_SYMBOLS (LED_CMD_MAX_SYMBOLS + LED_ARG_SYMBOLS + LED_START_SYMBOLS + LED_ADDR_SYMBOLS)
+
+/* The shortest frame has no argument, and with variable length codes,
+ * may have a command of a single symbol. */
+#ifdef LED_CMD_HUFFMAN
+#define LED_FRAME_MIN_SYMBOLS (1 + LED_START_SYMBOLS + LED_ADDR_SYMBOLS)
+#else
+#define LED_FRAME_MIN_SYMBOLS (LED_CMD_SYMBOLS + LED_START_SYMBOLS + LED_ADDR_SYMBOLS)
+#endif
+
+/* A command, its argument and its address are passed around as one
+ * value, with the command in the low LED_CMD_BITS, then the argument
+ * and then the address. */
+#ifdef LED_CMD_ARGS
+#define LED_ADDR_SHIFT (LED_CMD_BITS + LED_ARG_BITS)
+#else
+#define LED_ADDR_SHIFT LED_CMD_BITS
+#endif
+
+#define LED_CMD_WITH_ARG(led_cmd, arg) ((uintptr_t)(led_cmd) | ((uintptr_t)(arg) << LED_CMD_BITS))
+#define LED_CMD_TO(addr, led_cmd)      ((uintptr_t)(led_cmd) | ((uintptr_t)(addr) << LED_ADDR_SHIFT))
+#define LED_CMD_OPCODE(led_cmd)        ((led_cmd) & LED_CMD_MASK)
+#define LED_CMD_ARG(led_cmd)           (((led_cmd) & (((uintptr_t)1 << LED_ADDR_SHIFT) - 1)) >> LED_CMD_BITS)
+#define LED_CMD_ADDR(led_cmd)          ((led_cmd) >> LED_ADDR_SHIFT)
+
+/* The most lock toggles a single frame can need. Normally each symbol
+ * toggles a lock twice, while edge coding toggles a lock once per
+ * symbol and then up to once more per lock to restore them all. */
+#ifdef LED_EDGE_CODING
+#define LED_FRAME_TOGGLES(symbols) ((symbols) + LED_CMD_LOCKS)
+#else
+#define LED_FRAME_TOGGLES(symbols) (2 * (symbols))
+#endif
+
+#define LED_CMD_TOGGLES LED_FRAME_TOGGLES(LED_FRAME_SYMBOLS)
+
+#ifndef LED_CMD_QUEUE_SIZE
+#define LED_CMD_QUEUE_SIZE 8
+#endif
+
+/* Acknowledgements toggle a lock that can't start a frame, so they are
+ * never received as commands. */
+#ifdef LED_CMD_ACK
+#   ifndef LED_CMD_FRAMED
+#   error "LED_CMD_ACK needs LED_CMD_FRAMED"
+#   endif
+#   ifndef LED_ACK_BIT
+#       if LED_FRAME_START_BIT == NUM_LOCK_BIT
+#       define LED_ACK_BIT CAPS_LOCK_BIT
+#       else
+#       define LED_ACK_BIT NUM_LOCK_BIT
+#       endif
+#   endif
+#   ifndef LED_ACK_TIMEOUT
+#   define LED_ACK_TIMEOUT (LED_RCV_QUIET + 50)
+#   endif
+#   ifndef LED_CMD_RETRIES
+#   define LED_CMD_RETRIES 3
+#   endif
+#   ifndef LED_ACK_FORGET
+#   define LED_ACK_FORGET ((LED_ACK_TIMEOUT << LED_CMD_RETRIES) + (2 * LED_CMD_TIMEOUT))
+#   endif
+#endif
+
+/* With acknowledgements or resyncing, a receive window closes once the
+ * locks have been quiet this long, so a frame that lost a toggle doesn't
+ * hold it open. */
+#ifndef LED_RCV_QUIET
+#define LED_RCV_QUIET (LED_TOGGLE_TIME + 50)
+#endif
+
+/* With collision detection, a sender that sees a lock change it didn't
+ * make stops, restores the locks it toggled and tries again after a
+ * random backoff. Each device waits at least LED_DEVICE_ID + 1 backoff
+ * steps, so two devices that collide don't pick the same time. */
+#ifdef LED_COLLISION_DETECT
+#   ifndef LED_DEVICE_ID
+#   define LED_DEVICE_ID 0
+#   endif
+#   ifndef LED_BACKOFF_WAIT
+#   define LED_BACKOFF_WAIT LED_TOGGLE_TIME
+#   endif
+#   ifndef LED_COLLISION_RETRIES
+#   define LED_COLLISION_RETRIES 4
+#   endif
+#endif
+
+/* With calibration, each device measures how long the host takes to
+ * echo a toggle of each lock and keeps the waits that follow in
+ * EEPROM. The timings above are only used until then. Devices start
+ * LED_CAL_STAGGER apart by LED_DEVICE_ID, which allows for the slowest
+ * calibration, so none of them takes another's toggles for its echoes. */
+#ifdef LED_CALIBRATE
+#   ifndef LED_CAL_SAMPLES
+#   define LED_CAL_SAMPLES 4
+#   endif
+#   ifndef LED_CAL_MARGIN
+#   define LED_CAL_MARGIN 50
+#   endif
+#   ifndef LED_CAL_TIMEOUT
+#   define LED_CAL_TIMEOUT 500
+#   endif
+#   ifndef LED_CAL_DELAY
+#   define LED_CAL_DELAY 2000
+#   endif
+#   ifndef LED_DEVICE_ID
+#   define LED_DEVICE_ID 0
+#   endif
+#   ifndef LED_CAL_STAGGER
+#   define LED_CAL_STAGGER (LED_CMD_LOCKS * LED_CAL_SAMPLES * (LED_LOCK_WAIT + LED_CAL_TIMEOUT))
+#   endif
+#   if (LED_CAL_SAMPLES % 2) != 0
+#   error "LED_CAL_SAMPLES must be even, so every lock ends up where it started"
+#   endif
+/* Every device sees the calibration toggles. Without framing any of
+ * them can be taken for a command, and with edge coding every toggle is
+ * a symbol however they are ordered. */
+#   ifndef LED_CMD_FRAMED
+#   error "LED_CALIBRATE needs LED_CMD_FRAMED"
+#   endif
+#   ifdef LED_EDGE_CODING
+#   error "LED_CALIBRATE can't be used with LED_EDGE_CODING"
+#   endif
+#endif
+
+/* With statistics, bucket 0 of each histogram counts times under
+ * LED_STATS_FIRST_BUCKET ms, each bucket after it covers twice as long,
+ * and the last counts everything longer. */
+#ifdef LED_CMD_STATS
+#   define LED_STATS_BUCKETS 8
+#   ifndef LED_STATS_FIRST_BUCKET
+#   define LED_STATS_FIRST_BUCKET 16
+#   endif
+#   ifndef LED_STATS_INTERVAL
+#   define LED_STATS_INTERVAL 0
+#   endif
+#endif
+
+/* With the event log, console messages are kept in a ring buffer of
+ * LED_LOG_SIZE events and printed every LED_LOG_DRAIN ms, at most
+ * LED_LOG_BATCH at a time, once no command is being sent or received. */
+#ifdef LED_CMD_LOG
+#   ifndef CONSOLE_ENABLE
+#   error "LED_CMD_LOG needs CONSOLE_ENABLE"
+#   endif
+#   ifndef LED_LOG_SIZE
+#   define LED_LOG_SIZE 16
+#   endif
+#   ifndef LED_LOG_DRAIN
+#   define LED_LOG_DRAIN 20
+#   endif
+#   ifndef LED_LOG_BATCH
+#   define LED_LOG_BATCH 4
+#   endif
+/* The ring buffer is indexed and counted in 8 bits, and the count has
+ * to reach LED_LOG_SIZE itself */
+_Static_assert((LED_LOG_SIZE >= 1) && (LED_LOG_SIZE <= 255), "LED_LOG_SIZE must be between 1 and 255 events");
+#endif
+
+#if defined(LED_LOG_LOCKS) && !defined(LED_CMD_LOG)
+#error "LED_LOG_LOCKS needs LED_CMD_LOG, so each change is timestamped"
+#endif
+
+/* With the raw HID transport, commands go to a relay on the host as raw
+ * HID reports while it answers, and are sent with the locks if it
+ * hasn't acknowledged one within LED_RAW_ACK_WAIT ms. A device with no
+ * relay pings it at most every LED_RAW_PING_WAIT ms, when it has a
+ * command to send. */
+#ifdef LED_CMD_RAW_HID
+#   ifndef RAW_ENABLE
+#   error "LED_CMD_RAW_HID needs RAW_ENABLE"
+#   endif
+#   ifndef LED_RAW_ACK_WAIT
+#   define LED_RAW_ACK_WAIT 100
+#   endif
+#   ifndef LED_RAW_PING_WAIT
+#   define LED_RAW_PING_WAIT 1000
+#   endif
+#endif
+
+/* Raw HID reports to and from the relay, which relay/led_relay.c has
+ * its own copy of. Each report is LED_RAW_SIZE bytes, the QMK default,
+ * with the command in little-endian order. */
+#define LED_RAW_SIZE  32
+#define LED_RAW_MAGIC 0x4C
+
+typedef enum {
+    LED_RAW_MAGIC_AT,   /* LED_RAW_MAGIC, to tell them from other reports */
+    LED_RAW_TYPE_AT,    /* One of led_raw_type_t                          */
+    LED_RAW_SEQ_AT,     /* Matches each acknowledgement to its command    */
+    LED_RAW_FROM_AT,    /* LED_DEVICE_ID of the sender, for logging       */
+    LED_RAW_CMD_AT      /* The command, in the next four bytes            */
+} led_raw_field_t;
+
+typedef enum {
+    LED_RAW_PING,       /* Device asks if the relay is running            */
+    LED_RAW_PONG,       /* Relay answers, or has just started             */
+    LED_RAW_CMD,        /* A command, to the relay or from another device */
+    LED_RAW_ACK         /* The relay has passed a command on              */
+} led_raw_type_t;
+
 #ifndef LED_CMD_TIMEOUT
-#define LED_CMD_TIMEOUT (2 * LED_CAPS_WAIT * LED_CMD_BITS + 100)
+#define LED_CMD_TIMEOUT ((LED_TOGGLE_TIME * LED_CMD_TOGGLES) + 100)
 #endif
 
 #ifndef LED_CMD_SELF_WAIT
-#define LED_CMD_SELF_WAIT (LED_CMD_TIMEOUT - (2 * (LED_CAPS_WAIT + LED_BETWEEN_WAIT) * LED_CMD_BITS) + 100)
+#define LED_CMD_SELF_WAIT (LED_CMD_TIMEOUT - (LED_TOGGLE_TIME * LED_FRAME_TOGGLES(LED_FRAME_MIN_SYMBOLS)) + 100)
+#endif
+
+/* With echo clocking, a frame can be over long before LED_CMD_TIMEOUT,
+ * but without framing the receivers keep their windows open until then.
+ * The send window is held until LED_ECHO_HOLD after the first press,
+ * which leaves LED_LOCK_WAIT for that toggle to reach them. */
+#if defined(LED_ECHO_CLOCK) && !defined(LED_CMD_FRAMED)
+#define LED_ECHO_HOLD (LED_CMD_TIMEOUT + LED_LOCK_WAIT)
+#define LED_SEND_HOLD LED_ECHO_HOLD
+#else
+#define LED_SEND_HOLD 0
+#endif
+
+/* Timing model for a frame of the given number of symbols, counted
+ * from its first toggle, with every key held for its full wait and not
+ * counting how long the host takes to pass each toggle on. Receivers
+ * have the whole frame once the toggle for the last symbol is pressed,
+ * which with edge coding comes before the closing toggles, and the
+ * sender is done once the last key is released. Without framing, the
+ * channel is free again once the send window and every receive window
+ * have closed, while with framing, the windows close as soon as the
+ * frame is over, and the acknowledgement takes one more symbol. With
+ * echo clocking, each toggle can take as little as LED_BETWEEN_WAIT,
+ * which the _MIN_ figures use for the frame itself. */
+#ifdef LED_EDGE_CODING
+#define LED_FRAME_LATENCY(symbols)   (((symbols) - 1) * LED_TOGGLE_TIME)
+#else
+#define LED_FRAME_LATENCY(symbols)   ((LED_FRAME_TOGGLES(symbols) - 1) * LED_TOGGLE_TIME)
+#endif
+
+#define LED_FRAME_SEND_TIME(symbols) (((LED_FRAME_TOGGLES(symbols) - 1) * LED_TOGGLE_TIME) + LED_LOCK_WAIT)
+
+#ifdef LED_ECHO_CLOCK
+#define LED_FRAME_MIN_SEND_TIME(symbols) ((LED_FRAME_TOGGLES(symbols) - 1) * LED_BETWEEN_WAIT)
+#else
+#define LED_FRAME_MIN_SEND_TIME(symbols) LED_FRAME_SEND_TIME(symbols)
+#endif
+
+#if defined(LED_CMD_ACK)
+#define LED_BUSY_AFTER(send_time) ((send_time) + LED_TOGGLE_TIME + LED_LOCK_WAIT)
+#elif defined(LED_CMD_FRAMED)
+#define LED_BUSY_AFTER(send_time) (send_time)
+#else
+#define LED_BUSY_AFTER(send_time) LED_MAX(LED_MAX((send_time) + LED_CMD_SELF_WAIT, LED_SEND_HOLD), LED_CMD_TIMEOUT)
+#endif
+
+#define LED_FRAME_BUSY_TIME(symbols)     LED_BUSY_AFTER(LED_FRAME_SEND_TIME(symbols))
+#define LED_FRAME_MIN_BUSY_TIME(symbols) LED_BUSY_AFTER(LED_FRAME_MIN_SEND_TIME(symbols))
+
+/* Check that the timings can work at all. The sending loop stops on a
+ * wait of zero, as does any window given no time to close in, and
+ * every timing is kept in 16 bits. */
+#define LED_TIMING_FITS(timing) (((timing) >= 1) && ((timing) <= UINT16_MAX))
+
+_Static_assert(LED_TIMING_FITS(LED_NUM_WAIT) && LED_TIMING_FITS(LED_CAPS_WAIT) &&
+               LED_TIMING_FITS(LED_SCROLL_WAIT) && LED_TIMING_FITS(LED_BETWEEN_WAIT),
+               "The lock waits and LED_BETWEEN_WAIT must be between 1 and 65535 ms");
+_Static_assert(LED_TIMING_FITS(LED_CMD_TIMEOUT), "LED_CMD_TIMEOUT must be between 1 and 65535 ms");
+_Static_assert(LED_TIMING_FITS(LED_CMD_SELF_WAIT), "LED_CMD_SELF_WAIT must be between 1 and 65535 ms");
+
+/* Acknowledgements and resyncing keep the receive window open while
+ * toggles keep coming, so LED_RCV_QUIET is what has to be long enough */
+#if defined(LED_CMD_ACK) || defined(LED_RCV_RESYNC)
+_Static_assert(LED_TIMING_FITS(LED_RCV_QUIET) && (LED_RCV_QUIET > LED_TOGGLE_TIME),
+               "LED_RCV_QUIET closes the receive window between two toggles of a frame");
+#else
+_Static_assert(LED_CMD_TIMEOUT > LED_FRAME_LATENCY(LED_FRAME_SYMBOLS),
+               "LED_CMD_TIMEOUT closes the receive window before the longest frame can arrive");
+#endif
+
+/* Without framing, the send window has to stay open until the receive
+ * windows close, or the next command starts inside them. The shortest
+ * frame, sent as fast as it can be, is the one to check. */
+#ifndef LED_CMD_FRAMED
+_Static_assert(LED_MAX(LED_FRAME_MIN_SEND_TIME(LED_FRAME_MIN_SYMBOLS) + LED_CMD_SELF_WAIT, LED_SEND_HOLD) >= LED_CMD_TIMEOUT,
+               "LED_CMD_SELF_WAIT closes the send window before the receivers time out on the shortest frame");
+#endif
+
+#ifdef LED_CMD_ACK
+_Static_assert(LED_TIMING_FITS(LED_ACK_TIMEOUT) && (LED_ACK_TIMEOUT > LED_TOGGLE_TIME),
+               "LED_ACK_TIMEOUT gives up before an acknowledgement can finish");
+#endif
+
+#ifdef LED_COLLISION_DETECT
+_Static_assert(LED_TIMING_FITS(LED_BACKOFF_WAIT), "LED_BACKOFF_WAIT must be between 1 and 65535 ms");
+#endif
+
+
+typedef enum {
+    LED_CMD_KEEP,       /* Send both commands                           */
+    LED_CMD_REPLACE,    /* Only send the new command                    */
+    LED_CMD_CANCEL      /* The new command undoes the queued one        */
+} led_cmd_coalesce_t;
+
+typedef enum {
+    LED_RCV_FRAME,      /* Receiving the symbols of a frame             */
+    LED_RCV_DONE,       /* Frame received, waiting for it to end        */
+    LED_RCV_HUNT        /* Lost track of the frame, looking for another */
+} led_rcv_state_t;
+
+/* Console messages, as X(name, format of the arguments). Each message
+ * is the name followed by its formatted arguments. With LED_CMD_LOG,
+ * the device only prints the event number, a timestamp and the
+ * arguments, and sim/led_log_decode turns them back into messages. */
+#define LED_LOG_EVENTS(X)                                   \
+    X(SEND_LED_CMD,             ": %d")                     \
+    X(LED_CMD_NO_CODE,          "")                         \
+    X(LED_CMD_REPLACED,         ": %d")                     \
+    X(LED_CMD_CANCELLED,        ": %d")                     \
+    X(LED_CMD_QUEUE_FULL,       "")                         \
+    X(LED_CMD_CODE,             ": %d, %d symbols")         \
+    X(OPEN_RCV_WINDOW,          "")                         \
+    X(CLOSE_RCV_WINDOW,         "")                         \
+    X(CLOSE_SEND_WINDOW,        "")                         \
+    X(PROCESS_LED_CMD,          ": %d")                     \
+    X(LED_CMD_NOT_ADDRESSED,    ": %d")                     \
+    X(LED_CMD_CHECK_FAILED,     "")                         \
+    X(LED_RCV_DROPPED,          ": %d")                     \
+    X(LED_RCV_RESYNC,           ": %d")                     \
+    X(LED_CMD_ACK,              "")                         \
+    X(LED_CMD_DUPLICATE,        "")                         \
+    X(LED_CMD_RETRY,            ": %d")                     \
+    X(LED_CMD_NO_ACK,           ": %d")                     \
+    X(LED_CMD_COLLISION,        ": %d")                     \
+    X(LED_CMD_DROPPED,          ": %d")                     \
+    X(LED_CAL_START,            "")                         \
+    X(LED_CAL_LOADED,           ": %d %d")                  \
+    X(LED_CAL_DONE,             ": %d %d")                  \
+    X(LED_CAL_SCROLL,           ": %d")                     \
+    X(LED_CAL_FAILED,           ": %d")                     \
+    X(LED_LOG_LOST,             ": %d")                     \
+    X(LED_LOCKS,                ": %d")                     \
+    X(LED_RAW_SENT,             ": %d")                     \
+    X(LED_RAW_RECEIVED,         ": %d")                     \
+    X(LED_RAW_RELAY,            ": %d")                     \
+    X(LED_RAW_FALLBACK,         ": %d")
+
+#define LED_LOG_ENUM(name, format) LOG_##name,
+#define LED_LOG_FORMAT(name, format) #name format "\n",
+
+/* Keymaps can log their own events from LED_LOG_USER up */
+typedef enum {
+    LED_LOG_EVENTS(LED_LOG_ENUM)
+    LED_LOG_USER = 0x80
+} led_log_event_t;
+
+typedef enum {
+    LED_ACK_IDLE,       /* Not waiting for an acknowledgement           */
+    LED_ACK_WAIT,       /* Command sent, waiting for it to be acked     */
+    LED_ACK_SEEN        /* Acknowledged, waiting for the lock to return */
+} led_ack_state_t;
+
+/* The timings in use. These are the values from led_config.h, unless
+ * LED_CALIBRATE has measured them for this host. */
+typedef struct {
+    uint16_t num_wait;
+    uint16_t caps_wait;
+    uint16_t scroll_wait;
+    uint16_t between_wait;
+    uint16_t cmd_timeout;
+    uint16_t self_wait;
+    uint16_t rcv_quiet;
+    uint16_t ack_timeout;
+    uint16_t backoff_wait;
+} led_timing_t;
+
+/* Calibrated waits as stored in the user EEPROM word, with a check
+ * byte so that a blank or foreign value isn't used */
+typedef union {
+    uint32_t raw;
+    struct {
+        uint8_t num_wait;
+        uint8_t caps_wait;
+        uint8_t scroll_wait;
+        uint8_t check;
+    };
+} led_cal_config_t;
+
+typedef struct {
+    uint16_t resyncs;   /* Frames found again after losing track        */
+    uint16_t drops;     /* Frames lost part of the way through          */
+    uint16_t timeouts;  /* Of those, frames the window closed on        */
+} led_rcv_counts_t;
+
+#ifdef LED_CMD_STATS
+typedef struct {
+    uint16_t counts[LED_STATS_BUCKETS];
+    uint16_t max;
+} led_stats_histogram_t;
+
+/* Counters stop at their maximum instead of wrapping */
+typedef struct {
+    uint16_t sent;      /* Commands and acknowledgements sent           */
+    uint16_t received;  /* Commands passed to process_led_cmd           */
+    uint16_t dropped;   /* Receive windows that lost track of a frame   */
+    uint16_t ignored;   /* Toggles after the frame was complete         */
+    uint16_t retries;   /* Scheduler runs that found the channel busy   */
+    led_stats_histogram_t send_ms;      /* First press to last release  */
+    led_stats_histogram_t window_ms;    /* Receive window open to close */
+    led_stats_histogram_t latency_ms;   /* First toggle to processing   */
+} led_cmd_stats_t;
 #endif
 
 
@@ -60,18 +618,79 @@ bool led_update_cmd(led_t led_state);
 
 uint32_t send_led_cmd(uintptr_t led_cmd);
 
+led_cmd_coalesce_t coalesce_led_cmd(uintptr_t queued_cmd, uintptr_t led_cmd);
+
+led_rcv_counts_t led_rcv_counts(void);
+
+led_timing_t led_cmd_timing(void);
+
+uint8_t led_cmd_frame_symbols(uintptr_t led_cmd);
+
+#ifdef LED_CALIBRATE
+void led_calibrate(void);
+#endif
+
+#ifdef LED_CMD_RAW_HID
+bool led_raw_receive(uint8_t *data, uint8_t length);
+#endif
+
+#ifdef LED_CMD_LOG
+void led_log(uint8_t event, uint16_t arg0, uint16_t arg1);
+#endif
+
+#ifdef LED_CMD_STATS
+led_cmd_stats_t led_cmd_stats(void);
+
+void led_cmd_stats_reset(void);
+
+void led_cmd_stats_dump(void);
+#endif
+
+bool led_cmd_addressed(uint8_t addr);
+
+#ifdef LED_CMD_HUFFMAN
+extern const uint8_t led_cmd_weights[LED_CMD_COUNT];
+#endif
+
+#ifdef LED_CMD_ARGS
+extern const uint8_t led_cmd_arg_bits[LED_CMD_COUNT];
+#endif
+
 
 typedef struct {
-    uint8_t   bit_count;
+    uint8_t   symbol_count;
     uintptr_t raw_led_cmd;
-    uint8_t   num_lock_count;
-    uint8_t   caps_lock_count;
-    bool      valid_cmd;
+    uint8_t   pending_lock;
+    led_rcv_state_t state;
+    uintptr_t led_cmd;
+    uint8_t   arg_start;
+    uint8_t   seq;
+    uint8_t   addr;
+    bool      addressed;
+    uint8_t   start_locks;
+#   ifdef LED_RCV_RESYNC
+    uint8_t   history[LED_FRAME_SYMBOLS];
+#   endif
 } cmd_window_state_t;
 
 typedef struct {
-    uint8_t   current_bit;
-    uintptr_t  raw_led_cmd;
+    uintptr_t led_cmd;
+    uint8_t   current_symbol;
+    uint8_t   cmd_symbols;
+    uint8_t   arg_symbols;
+    uintptr_t raw_led_cmd;
+    uintptr_t raw_arg;
+    bool      ack;
     bool      key_down;
     bool      first_stage;
+    bool      closing;
+    uint8_t   parity;
+    bool      sent;
+    uint8_t   outstanding;
+    bool      collided;
+    uint8_t   start_locks;
+#   ifdef LED_ECHO_HOLD
+    uint32_t  start_time;
+#   endif
+    deferred_token token;
 } led_cmd_out;
@@ -28,10 +28,106 @@
 #include "led_enum.h"
 #include "features/led_comm.h"
 
-/* Options for scrolling threshold */
+/* Sensor counts for one wheel notch in each direction */
 #define DELTA_X_THRESHOLD 100
 #define DELTA_Y_THRESHOLD 50
 
+/* With hi-res scrolling, each notch is split into this many wheel
+ * units, so scrolling follows the ball instead of moving in notches */
+#ifdef POINTING_DEVICE_HIRES_SCROLL_ENABLE
+#define SCROLL_RESOLUTION pointing_device_get_hires_scroll_resolution()
+#else
+#define SCROLL_RESOLUTION 1
+#endif
+
+/* The largest wheel and movement values one report can hold */
+#ifndef HV_REPORT_MAX
+#define HV_REPORT_MAX 127
+#endif
+
+#ifndef XY_REPORT_MAX
+#define XY_REPORT_MAX 127
+#endif
+
+/* With momentum, a flick keeps scrolling after the ball stops, slowing
+ * down each SCROLL_MOMENTUM_INTERVAL ms to SCROLL_MOMENTUM_DECAY/256 of
+ * its speed. It only starts if the ball was moving at least
+ * SCROLL_MOMENTUM_THRESHOLD sensor counts per interval when it
+ * stopped. */
+#ifdef SCROLL_MOMENTUM
+#   ifndef SCROLL_MOMENTUM_INTERVAL
+#   define SCROLL_MOMENTUM_INTERVAL 8
+#   endif
+#   ifndef SCROLL_MOMENTUM_DECAY
+#   define SCROLL_MOMENTUM_DECAY 240
+#   endif
+#   ifndef SCROLL_MOMENTUM_THRESHOLD
+#   define SCROLL_MOMENTUM_THRESHOLD 24
+#   endif
+#   if (SCROLL_MOMENTUM_DECAY < 1) || (SCROLL_MOMENTUM_DECAY > 255)
+#   error "SCROLL_MOMENTUM_DECAY must be between 1 and 255"
+#   endif
+#endif
+
+/* Acceleration curves for the movement side, as the gain in 1/256 at
+ * each speed in sensor counts per report, from 0 up. Faster reports
+ * use the last gain. Slow movement is scaled down for precision and
+ * fast movement up for travel, so the DPI rarely needs changing.
+ * ACCEL_CURVE_DEFAULT picks a curve, and so does SET_ACCEL with
+ * LED_CMD_SET_ACCEL in led_config.h. */
+#define ACCEL_SPEEDS 16
+#define ACCEL_CURVES {                                                          \
+    /* Flat, the sensor as it is */                                             \
+    { 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256 }, \
+    /* Mild */                                                                  \
+    { 192, 192, 208, 224, 240, 256, 272, 288, 320, 352, 384, 416, 448, 480, 512, 512 }, \
+    /* Strong */                                                                \
+    { 128, 128, 160, 192, 224, 256, 304, 352, 400, 448, 512, 576, 640, 704, 768, 768 }  \
+}
+#ifndef ACCEL_CURVE_DEFAULT
+#define ACCEL_CURVE_DEFAULT 0
+#endif
+
+/* In precision mode, the ball that would be scrolling moves the pointer
+ * as well, scaled down to FINE_RATIO/256 of its motion, so one hand
+ * can make fine adjustments while the other covers distance. */
+#ifndef FINE_RATIO
+#define FINE_RATIO 64
+#endif
+
+#if (FINE_RATIO < 1) || (FINE_RATIO > 256)
+#error "FINE_RATIO must be between 1 and 256"
+#endif
+
+/* With handoff, moving the scrolling ball on purpose makes it the
+ * movement ball straight away, and the other ball is told to scroll.
+ * Motion only counts in each HANDOFF_INTERVAL ms of at least
+ * HANDOFF_SPEED sensor counts, and starts counting again from zero
+ * after an interval under half that, so scrolling slowly or bumping
+ * the ball doesn't add up. The handoff takes HANDOFF_DISTANCE counts
+ * in all, and can't happen within HANDOFF_HOLDOFF ms of the ball last
+ * changing roles. */
+#ifdef SCROLL_HANDOFF
+#   ifndef HANDOFF_INTERVAL
+#   define HANDOFF_INTERVAL 20
+#   endif
+#   ifndef HANDOFF_SPEED
+#   define HANDOFF_SPEED 40
+#   endif
+#   ifndef HANDOFF_DISTANCE
+#   define HANDOFF_DISTANCE 600
+#   endif
+#   ifndef HANDOFF_HOLDOFF
+#   define HANDOFF_HOLDOFF 1000
+#   endif
+/* A handoff sent to every device reaches the ball that is about to
+ * scroll, which never acknowledges, so it would be sent again and
+ * again */
+#   if defined(LED_CMD_ACK) && !defined(LED_CMD_ADDRESS)
+#   error "SCROLL_HANDOFF with LED_CMD_ACK needs LED_CMD_ADDRESS"
+#   endif
+#endif
+
 /* DPI options */
 #define LOW_DPI     350
 #define MID_DPI     750
@@ -46,143 +142,494 @@
 #define LEFT_SIDE (false)
 #endif
 
-/* Static variables for scrolling */
-static bool   scroll_enabled = LEFT_SIDE;
-static int8_t delta_x        = 0;
-static int8_t delta_y        = 0;
+/* Static variables for scrolling. The deltas are sensor counts times
+ * SCROLL_RESOLUTION that haven't been sent as wheel units yet. */
+static bool    scroll_enabled = LEFT_SIDE;
+static int32_t delta_x        = 0;
+static int32_t delta_y        = 0;
+
+/* Whether precision mode is on, set by SET_FINE */
+static bool fine_enabled = false;
+
+/* Static variables for acceleration and precision mode. The carries
+ * are 1/256 sensor counts that haven't been sent yet. */
+static uint8_t accel_curve   = ACCEL_CURVE_DEFAULT;
+static int16_t accel_carry_x = 0;
+static int16_t accel_carry_y = 0;
+
+#ifdef SCROLL_HANDOFF
+/* Motion towards a handoff, and when this ball last changed roles */
+static uint16_t handoff_distance = 0;
+static uint16_t handoff_counts   = 0;
+static uint32_t handoff_time     = 0;
+static uint32_t role_time        = 0;
+#endif
+
+#ifdef SCROLL_MOMENTUM
+/* Velocities are in 1/256 sensor counts per SCROLL_MOMENTUM_INTERVAL.
+ * While the ball moves, they follow the counts seen in each interval,
+ * and once it stops they are what keeps being scrolled. */
+typedef struct {
+    int32_t velocity;
+    int32_t carry;      /* Fraction of a count not sent yet */
+    int16_t counts;     /* Counts so far this interval      */
+} momentum_axis_t;
+
+static momentum_axis_t momentum_x    = { 0, 0, 0 };
+static momentum_axis_t momentum_y    = { 0, 0, 0 };
+static bool            coasting      = false;
+static uint32_t        momentum_time = 0;
+#endif
+
+#ifdef LED_CMD_HUFFMAN
+/* Give the most common commands the shortest codes */
+const uint8_t led_cmd_weights[LED_CMD_COUNT] = LED_CMD_WEIGHTS;
+#endif
+
+#ifdef LED_CMD_ARGS
+/* How many bits of argument each command carries */
+const uint8_t led_cmd_arg_bits[LED_CMD_COUNT] = LED_CMD_ARG_BITS;
+#endif
+
+#ifdef LED_CMD_ARGS
+/* DPI settings selected by the argument of ACT_SET_DPI */
+static const uint16_t dpi_options[] = PLOOPY_DPI_OPTIONS;
+#endif
+
+/* Acceleration curves selected by ACCEL_CURVE_DEFAULT and SET_ACCEL */
+static const uint16_t accel_curves[][ACCEL_SPEEDS] = ACCEL_CURVES;
+
+#define ACCEL_CURVE_COUNT (sizeof(accel_curves) / sizeof(accel_curves[0]))
+
+_Static_assert(ACCEL_CURVE_DEFAULT < ACCEL_CURVE_COUNT, "ACCEL_CURVE_DEFAULT is not one of ACCEL_CURVES");
+
+/* Console messages, from LED_LOG_USER_EVENTS in led_enum.h. With
+ * LED_CMD_LOG, they go to the event log instead of being printed while
+ * the command is being handled. */
+enum {
+    LOG_MOUSE_BEFORE = LED_LOG_USER - 1,
+    LED_LOG_USER_EVENTS(LED_LOG_ENUM)
+};
+
+#if defined(LED_CMD_LOG)
+#define MOUSE_LOG(event, arg) led_log(LOG_##event, !LEFT_SIDE, arg)
+#elif defined(CONSOLE_ENABLE)
+static const char *const mouse_log_formats[] = { LED_LOG_USER_EVENTS(LED_LOG_FORMAT) };
+
+#define MOUSE_LOG(event, arg) uprintf(mouse_log_formats[LOG_##event - LED_LOG_USER], !LEFT_SIDE, arg)
+#else
+#define MOUSE_LOG(event, arg)
+#endif
+
+#ifdef LED_CMD_ADDRESS
+/* Take commands sent to every device, to this side, or to the role
+ * this trackball currently has */
+bool led_cmd_addressed(uint8_t addr) {
+    switch (addr) {
+        case ADDR_ALL:
+            return true;
+
+        case ADDR_LEFT:
+            return LEFT_SIDE;
+
+        case ADDR_RIGHT:
+            return !LEFT_SIDE;
+
+        case ADDR_MOVE:
+            return !scroll_enabled;
+
+        case ADDR_SCROLL:
+            return scroll_enabled;
+
+        default:
+            return false;
+    }
+}
+#endif
 
 /* Dummy keymap (no keys!) */
 const uint16_t PROGMEM keymaps[][MATRIX_ROWS][MATRIX_COLS] = {{{KC_NO}}};
 
-/* Add scrolling functionality in scrolling mode */
-report_mouse_t pointing_device_task_user(report_mouse_t mouse_report) {
-    if (scroll_enabled) {
-        delta_x += mouse_report.x;
-        delta_y += mouse_report.y;
-
-        if (delta_x > DELTA_X_THRESHOLD) {
-            mouse_report.h = 1;
-            delta_x        = 0;
-        } else if (delta_x < -DELTA_X_THRESHOLD) {
-            mouse_report.h = -1;
-            delta_x        = 0;
-        }
+/* Add sensor counts to a scroll delta and take out as many whole wheel
+ * units as one report can hold, keeping the remainder for the next
+ * report. No more than one more report's worth is carried over, so a
+ * fast flick doesn't keep scrolling after the ball stops. */
+static int16_t scroll_units(int32_t *delta, int16_t counts, int32_t threshold) {
+    const int32_t max_carry = (int32_t)HV_REPORT_MAX * threshold;
+    int32_t       units;
+
+    *delta += (int32_t)counts * SCROLL_RESOLUTION;
+    units   = *delta / threshold;
+
+    if (units > HV_REPORT_MAX) {
+        units = HV_REPORT_MAX;
+    } else if (units < -HV_REPORT_MAX) {
+        units = -HV_REPORT_MAX;
+    }
+    *delta -= units * threshold;
+
+    if (*delta > max_carry) {
+        *delta = max_carry;
+    } else if (*delta < -max_carry) {
+        *delta = -max_carry;
+    }
+
+    return (int16_t)units;
+}
+
+#ifdef SCROLL_MOMENTUM
+static void momentum_stop(void) {
+    coasting   = false;
+    momentum_x = (momentum_axis_t){ 0, 0, 0 };
+    momentum_y = (momentum_axis_t){ 0, 0, 0 };
+}
+
+/* int is only 16 bits on the Nano, so abs can't be used */
+static int32_t momentum_speed(const momentum_axis_t *axis) {
+    return (axis->velocity < 0) ? -axis->velocity : axis->velocity;
+}
+
+/* Follow the speed of the ball once per interval */
+static void momentum_track(momentum_axis_t *axis) {
+    /* Average over the last couple of intervals, so one slow sensor
+     * read at the end of a flick doesn't set the speed */
+    axis->velocity += (((int32_t)axis->counts * 256) - axis->velocity) / 2;
+    axis->counts    = 0;
+}
+
+/* Scroll one interval's worth while coasting, and slow down */
+static int16_t momentum_coast(momentum_axis_t *axis) {
+    int32_t counts;
+
+    axis->carry += axis->velocity;
+    counts       = axis->carry / 256;
+
+    if (counts > XY_REPORT_MAX) {
+        counts = XY_REPORT_MAX;
+    } else if (counts < -XY_REPORT_MAX) {
+        counts = -XY_REPORT_MAX;
+    }
+
+    axis->carry   -= counts * 256;
+    axis->velocity = (axis->velocity * SCROLL_MOMENTUM_DECAY) / 256;
+
+    return (int16_t)counts;
+}
+
+/* Add the momentum of the last flick to a scrolling report. Any motion
+ * while coasting means the ball has been touched, which stops it. */
+static void scroll_momentum(report_mouse_t *mouse_report) {
+    bool moved = (mouse_report->x != 0) || (mouse_report->y != 0);
+
+    if (moved && coasting) {
+        momentum_stop();
+    }
+
+    momentum_x.counts += mouse_report->x;
+    momentum_y.counts += mouse_report->y;
+
+    if (timer_elapsed32(momentum_time) < SCROLL_MOMENTUM_INTERVAL) {
+        return;
+    }
+    momentum_time = timer_read32();
+
+    if (coasting) {
+        mouse_report->x = momentum_coast(&momentum_x);
+        mouse_report->y = momentum_coast(&momentum_y);
 
-        if (delta_y > DELTA_Y_THRESHOLD) {
-            mouse_report.v = -1;
-            delta_y        = 0;
-        } else if (delta_y < -DELTA_Y_THRESHOLD) {
-            mouse_report.v = 1;
-            delta_y        = 0;
+        /* Stop once it is down to a quarter count per interval */
+        if ((momentum_speed(&momentum_x) < 64) && (momentum_speed(&momentum_y) < 64)) {
+            momentum_stop();
         }
-        mouse_report.x = 0;
-        mouse_report.y = 0;
+    } else if ((momentum_x.counts != 0) || (momentum_y.counts != 0)) {
+        momentum_track(&momentum_x);
+        momentum_track(&momentum_y);
+    } else if ((momentum_speed(&momentum_x) >= (int32_t)SCROLL_MOMENTUM_THRESHOLD * 256) ||
+               (momentum_speed(&momentum_y) >= (int32_t)SCROLL_MOMENTUM_THRESHOLD * 256)) {
+        /* The ball stopped after a flick */
+        coasting = true;
+    } else {
+        momentum_stop();
     }
-    return mouse_report;
 }
+#endif
 
-/* Handle communication from other QMK devices */
-bool process_led_cmd(uintptr_t led_cmd) {
-    switch (led_cmd) {
-        case LFT_MOUSE:
-            /* Set to movement if left mouse, scrolling otherwise */
-#           ifdef CONSOLE_ENABLE
-            if (LEFT_SIDE) {
-                uprintf("LFT_MOUSE - mouse %d disabling scroll\n", !LEFT_SIDE);
-            } else {
-                uprintf("LFT_MOUSE - mouse %d enabling scroll\n", !LEFT_SIDE);
-            }
-#           endif
-            pointing_device_set_cpi(MID_DPI);
-            scroll_enabled = !LEFT_SIDE;
-            break;
+/* Scale one axis by the gain, keeping the fraction of a count for the
+ * next report. Anything past the largest report is dropped, so the
+ * pointer doesn't keep moving after the ball stops. */
+static int16_t accel_axis(int16_t *carry, int16_t counts, uint16_t gain) {
+    int32_t scaled = ((int32_t)counts * gain) + *carry;
+    int32_t moved  = scaled / 256;
 
-        case RGT_MOUSE:
-            /* Set to movement if right mouse, scrolling otherwise */
-#           ifdef CONSOLE_ENABLE
-            if (!LEFT_SIDE) {
-                uprintf("RGT_MOUSE - mouse %d disabling scroll\n", !LEFT_SIDE);
-            } else {
-                uprintf("RGT_MOUSE - mouse %d enabling scroll\n", !LEFT_SIDE);
-            }
-#           endif
-            pointing_device_set_cpi(MID_DPI);
-            scroll_enabled = LEFT_SIDE;
-            break;
+    if (moved > XY_REPORT_MAX) {
+        moved = XY_REPORT_MAX;
+    } else if (moved < -XY_REPORT_MAX) {
+        moved = -XY_REPORT_MAX;
+    }
 
-        case CYCLE_DPI:
-            /* Cycle DPI regardless of side. Only way to
-             * (temporarily) change scrolling DPI */
-            cycle_dpi();
-#           ifdef CONSOLE_ENABLE
-            uprintf("CYC_DPI - mouse %d set to %d\n", !LEFT_SIDE, pointing_device_get_cpi());
-#           endif
-            break;
+    scaled -= moved * 256;
+    *carry  = (scaled > 255) ? 255 : (scaled < -255) ? -255 : (int16_t)scaled;
 
-        case ACT_HI_DPI:
-            /* Set to high DPI if this is the movement side */
-            if (!scroll_enabled) {
-#               ifdef CONSOLE_ENABLE
-                uprintf("ACT_HI_DPI - mouse %d changing\n", !LEFT_SIDE);
-#               endif
-                pointing_device_set_cpi(HI_DPI);
-            } else {
-#               ifdef CONSOLE_ENABLE
-                uprintf("ACT_HI_DPI - mouse %d ignoring\n", !LEFT_SIDE);
-#               endif
-            }
-            break;
+    return (int16_t)moved;
+}
 
-        case ACT_MID_DPI:
-            /* Set to medium DPI if this is the movement side */
-            if (!scroll_enabled) {
-#               ifdef CONSOLE_ENABLE
-                uprintf("ACT_MID_DPI - mouse %d changing\n", !LEFT_SIDE);
-#               endif
-                pointing_device_set_cpi(MID_DPI);
-            } else {
-#               ifdef CONSOLE_ENABLE
-                uprintf("ACT_MID_DPI - mouse %d ignoring\n", !LEFT_SIDE);
-#               endif
+/* Apply the acceleration curve to a movement report. The speed is the
+ * larger axis plus half the smaller, which is close to the length of
+ * the movement without a square root. */
+static void pointer_accel(report_mouse_t *mouse_report) {
+    int16_t  x     = (mouse_report->x < 0) ? -mouse_report->x : mouse_report->x;
+    int16_t  y     = (mouse_report->y < 0) ? -mouse_report->y : mouse_report->y;
+    uint16_t speed = (x > y) ? (x + (y / 2)) : (y + (x / 2));
+    uint16_t gain  = accel_curves[accel_curve][(speed < ACCEL_SPEEDS) ? speed : (ACCEL_SPEEDS - 1)];
+
+    mouse_report->x = accel_axis(&accel_carry_x, mouse_report->x, gain);
+    mouse_report->y = accel_axis(&accel_carry_y, mouse_report->y, gain);
+}
+
+/* Switch this ball between scrolling and moving the pointer */
+static void set_scrolling(bool scrolling) {
+    MOUSE_LOG(MOUSE_SCROLL, scrolling);
+    pointing_device_set_cpi(MID_DPI);
+    scroll_enabled = scrolling;
+    delta_x        = 0;
+    delta_y        = 0;
+    accel_carry_x  = 0;
+    accel_carry_y  = 0;
+
+#   ifdef SCROLL_HANDOFF
+    handoff_distance = 0;
+    role_time        = timer_read32();
+#   endif
+}
+
+#ifdef SCROLL_HANDOFF
+/* Whether the scrolling ball has been moved far and fast enough to
+ * take over the pointer */
+static bool handoff_check(const report_mouse_t *mouse_report) {
+    handoff_counts += ((mouse_report->x < 0) ? -mouse_report->x : mouse_report->x) +
+                      ((mouse_report->y < 0) ? -mouse_report->y : mouse_report->y);
+
+    if (timer_elapsed32(handoff_time) < HANDOFF_INTERVAL) {
+        return false;
+    }
+    handoff_time = timer_read32();
+
+    if (handoff_counts >= HANDOFF_SPEED) {
+        handoff_distance += handoff_counts;
+    } else if (handoff_counts < HANDOFF_SPEED / 2) {
+        handoff_distance = 0;
+    }
+    handoff_counts = 0;
+
+    return (handoff_distance >= HANDOFF_DISTANCE) &&
+           (timer_elapsed32(role_time) >= HANDOFF_HOLDOFF);
+}
+
+/* Take over the pointer in this report, and tell the other ball to
+ * scroll. With LED_CMD_ADDRESS, the command goes to the other ball
+ * only, so it can acknowledge it. */
+static void handoff(void) {
+    uintptr_t led_cmd = LEFT_SIDE ? LFT_MOUSE : RGT_MOUSE;
+
+    set_scrolling(false);
+
+#   ifdef LED_CMD_ADDRESS
+    send_led_cmd(LED_CMD_TO(LEFT_SIDE ? ADDR_RIGHT : ADDR_LEFT, led_cmd));
+#   else
+    send_led_cmd(led_cmd);
+#   endif
+}
+#endif
+
+/* Commands that set a state only need the last one sent, such as a
+ * handoff that is still waiting to be sent or a DPI key mashed faster
+ * than the commands can go out */
+led_cmd_coalesce_t coalesce_led_cmd(uintptr_t queued_cmd, uintptr_t led_cmd) {
+    uintptr_t queued = LED_CMD_OPCODE(queued_cmd);
+
+    switch (LED_CMD_OPCODE(led_cmd)) {
+        case LFT_MOUSE:
+        case RGT_MOUSE:
+            if ((queued == LFT_MOUSE) || (queued == RGT_MOUSE)) {
+                return LED_CMD_REPLACE;
             }
             break;
 
+        case ACT_HI_DPI:
+        case ACT_MID_DPI:
         case ACT_LOW_DPI:
-            /* Set to low DPI if this is the movement side */
-            if (!scroll_enabled) {
-#               ifdef CONSOLE_ENABLE
-                uprintf("ACT_LOW_DPI - mouse %d changing\n", !LEFT_SIDE);
-#               endif
-                pointing_device_set_cpi(LOW_DPI);
-            } else {
-#               ifdef CONSOLE_ENABLE
-                uprintf("ACT_LOW_DPI - mouse %d ignoring\n", !LEFT_SIDE);
-#               endif
+            if ((queued == ACT_HI_DPI) || (queued == ACT_MID_DPI) ||
+                (queued == ACT_LOW_DPI)) {
+                return LED_CMD_REPLACE;
             }
             break;
+    }
 
-        case ACT_RESET:
-            /* Reset the trackball if currently in scrolling mode */
-            if (scroll_enabled) {
-#               ifdef CONSOLE_ENABLE
-                uprintf("ACT_RESET - mouse %d resetting\n", !LEFT_SIDE);
-#               endif
-                reset_keyboard();
-            } else {
-#               ifdef CONSOLE_ENABLE
-                uprintf("ACT_RESET - mouse %d ignoring\n", !LEFT_SIDE);
-#               endif
-            }
-            break;
+    return LED_CMD_KEEP;
+}
 
-        default:
-            /* Ignore unrecognised commands. */
-#           ifdef CONSOLE_ENABLE
-            uprintf("Unhandled LED command - mouse %d\n", !LEFT_SIDE);
-#           endif
+/* Add scrolling functionality in scrolling mode, and fine adjustment
+ * in its place in precision mode */
+report_mouse_t pointing_device_task_user(report_mouse_t mouse_report) {
+#   ifdef SCROLL_HANDOFF
+    if (scroll_enabled && !fine_enabled && handoff_check(&mouse_report)) {
+        handoff();
+    }
+#   endif
 
-            return false;
+    bool scrolling = scroll_enabled && !fine_enabled;
+
+#   ifdef SCROLL_MOMENTUM
+    if (scrolling) {
+        scroll_momentum(&mouse_report);
+    } else if (coasting) {
+        momentum_stop();
     }
+#   endif
 
-    return true;
+    if (scrolling) {
+        mouse_report.h = scroll_units(&delta_x, mouse_report.x, DELTA_X_THRESHOLD);
+        mouse_report.v = -scroll_units(&delta_y, mouse_report.y, DELTA_Y_THRESHOLD);
+        mouse_report.x = 0;
+        mouse_report.y = 0;
+    } else if (scroll_enabled) {
+        mouse_report.x = accel_axis(&accel_carry_x, mouse_report.x, FINE_RATIO);
+        mouse_report.y = accel_axis(&accel_carry_y, mouse_report.y, FINE_RATIO);
+    } else {
+        pointer_accel(&mouse_report);
+    }
+    return mouse_report;
 }
+
+/* Handlers for communication from other QMK devices, one for each
+ * command in LED_CMD_TABLE, named after it */
+static void handle_LFT_MOUSE(uintptr_t led_cmd) {
+    /* Set to movement if left mouse, scrolling otherwise */
+    set_scrolling(!LEFT_SIDE);
+}
+
+static void handle_RGT_MOUSE(uintptr_t led_cmd) {
+    /* Set to movement if right mouse, scrolling otherwise */
+    set_scrolling(LEFT_SIDE);
+}
+
+static void handle_CYCLE_DPI(uintptr_t led_cmd) {
+    /* Cycle DPI regardless of side. Only way to
+     * (temporarily) change scrolling DPI */
+    cycle_dpi();
+    MOUSE_LOG(MOUSE_DPI, pointing_device_get_cpi());
+}
+
+/* Set the DPI if this is the movement side */
+static void set_movement_dpi(uintptr_t led_cmd, uint16_t dpi) {
+    if (scroll_enabled) {
+        MOUSE_LOG(MOUSE_IGNORED, LED_CMD_OPCODE(led_cmd));
+        return;
+    }
+
+    MOUSE_LOG(MOUSE_DPI, dpi);
+    pointing_device_set_cpi(dpi);
+}
+
+#ifdef LED_CMD_ARGS
+static void handle_ACT_SET_DPI(uintptr_t led_cmd) {
+    /* Set the DPI option given in the argument */
+    if (LED_CMD_ARG(led_cmd) < (sizeof(dpi_options) / sizeof(dpi_options[0]))) {
+        set_movement_dpi(led_cmd, dpi_options[LED_CMD_ARG(led_cmd)]);
+    } else {
+        MOUSE_LOG(MOUSE_IGNORED, LED_CMD_OPCODE(led_cmd));
+    }
+}
+#endif
+
+static void handle_ACT_HI_DPI(uintptr_t led_cmd) {
+    set_movement_dpi(led_cmd, HI_DPI);
+}
+
+static void handle_ACT_MID_DPI(uintptr_t led_cmd) {
+    set_movement_dpi(led_cmd, MID_DPI);
+}
+
+static void handle_ACT_LOW_DPI(uintptr_t led_cmd) {
+    set_movement_dpi(led_cmd, LOW_DPI);
+}
+
+static void handle_ACT_RESET(uintptr_t led_cmd) {
+    /* Reset the trackball if currently in scrolling mode */
+    if (scroll_enabled) {
+        MOUSE_LOG(MOUSE_RESET, 0);
+        reset_keyboard();
+    } else {
+        MOUSE_LOG(MOUSE_IGNORED, LED_CMD_OPCODE(led_cmd));
+    }
+}
+
+#ifdef LED_CMD_SET_ACCEL
+static void handle_SET_ACCEL(uintptr_t led_cmd) {
+#   ifdef LED_CMD_ARGS
+    /* Use the curve given in the argument */
+    if (LED_CMD_ARG(led_cmd) >= ACCEL_CURVE_COUNT) {
+        MOUSE_LOG(MOUSE_IGNORED, LED_CMD_OPCODE(led_cmd));
+        return;
+    }
+    accel_curve = LED_CMD_ARG(led_cmd);
+#   else
+    /* Move on to the next curve */
+    accel_curve = (accel_curve + 1) % ACCEL_CURVE_COUNT;
+#   endif
+
+    accel_carry_x = 0;
+    accel_carry_y = 0;
+    MOUSE_LOG(MOUSE_ACCEL, accel_curve);
+}
+#endif
+
+#ifdef LED_CMD_SET_FINE
+static void handle_SET_FINE(uintptr_t led_cmd) {
+#   ifdef LED_CMD_ARGS
+    /* Turn precision mode on or off as given in the argument */
+    fine_enabled = (LED_CMD_ARG(led_cmd) != 0);
+#   else
+    /* Turn precision mode on if it is off, and off if it is on */
+    fine_enabled = !fine_enabled;
+#   endif
+
+    delta_x       = 0;
+    delta_y       = 0;
+    accel_carry_x = 0;
+    accel_carry_y = 0;
+    MOUSE_LOG(MOUSE_FINE, fine_enabled);
+}
+#endif
+
+typedef void (*led_cmd_handler_t)(uintptr_t led_cmd);
+
+#define LED_CMD_HANDLER(name, code, weight, arg_bits) [code] = handle_##name,
+
+/* Handlers indexed by command code, so each command is one lookup */
+static const led_cmd_handler_t led_cmd_handlers[LED_CMD_COUNT] = { LED_CMD_TABLE(LED_CMD_HANDLER) };
+
+/* Handle communication from other QMK devices */
+bool process_led_cmd(uintptr_t led_cmd) {
+    led_cmd_handler_t handler = led_cmd_handlers[LED_CMD_OPCODE(led_cmd)];
+
+    if (handler == NULL) {
+        /* Ignore unrecognised commands. */
+        MOUSE_LOG(MOUSE_UNHANDLED, LED_CMD_OPCODE(led_cmd));
+        return false;
+    }
+
+    handler(led_cmd);
+
+    /* Commands sent to one trackball are acknowledged by it. Otherwise
+     * only the movement trackball acknowledges, so that
+     * acknowledgements from both trackballs don't collide. */
+    return (LED_CMD_ADDR(led_cmd) != ADDR_ALL) || !scroll_enabled;
+}
+
+#ifdef LED_CMD_RAW_HID
+/* Commands from the host relay arrive as raw HID reports */
+void raw_hid_receive(uint8_t *data, uint8_t length) {
+    led_raw_receive(data, length);
+}
+#endif
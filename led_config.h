@@ -48,12 +48,60 @@
  */
 #define LED_CAPS_WAIT 60
 
+/* Similarly define how long the scroll lock key is held. This is only
+ * used with LED_SCROLL_LOCK_CODING.
+#define LED_SCROLL_WAIT LED_NUM_WAIT
+ */
+
+/* Define to use the host's echo of each lock toggle as the clock while
+ * sending. The sender releases the key and moves on as soon as its own
+ * LED state shows the toggle, so LED_NUM_WAIT and LED_CAPS_WAIT only
+ * act as a timeout when the echo is late or lost. On an idle host this
+ * takes a few milliseconds per toggle, while a loaded host still gets
+ * the full wait. Without LED_CMD_FRAMED, the receivers still wait for
+ * LED_CMD_TIMEOUT, so the sender holds the channel until then.
+#define LED_ECHO_CLOCK
+ */
+
 /* Define the time between key presses. This cannot be zero due to how it
  * is used in the code.
 #define LED_BETWEEN_WAIT 1
  */
 #define LED_BETWEEN_WAIT 5
 
+/* Define to measure the waits above for the host each device is plugged
+ * into, rather than relying on them. Shortly after the first startup, a
+ * device toggles each lock a few times, times how long the host takes
+ * to echo each toggle, and stores the longest, plus a safety margin, in
+ * the user EEPROM word. LED_CMD_TIMEOUT, LED_CMD_SELF_WAIT and the other
+ * timings are then worked out from the measured waits, so a fast host
+ * gets fast commands without reflashing. The values in this file are
+ * only used until then. Call led_calibrate() to measure again, such as
+ * after moving to another computer. This takes over the user EEPROM
+ * word, so it can't be used by the keymap as well. It needs
+ * LED_CMD_FRAMED, and can't be used with LED_EDGE_CODING, so the other
+ * devices don't take the toggles for a command.
+#define LED_CALIBRATE
+ */
+
+/* Define how many times each lock is toggled while calibrating, which
+ * must be even, and how much longer than the slowest echo, in percent,
+ * the waits are made.
+#define LED_CAL_SAMPLES 4
+#define LED_CAL_MARGIN 50
+ */
+
+/* Define how long calibration waits for an echo after releasing a key
+ * before giving up and keeping the timings it had, and how long after
+ * startup it runs when nothing is stored yet, so the host has time to
+ * set up the keyboard. Each device waits another LED_CAL_STAGGER for
+ * each step of its LED_DEVICE_ID, so devices flashed together take
+ * turns instead of taking each other's toggles for their own echoes.
+#define LED_CAL_TIMEOUT 500
+#define LED_CAL_DELAY 2000
+#define LED_CAL_STAGGER (LED_CMD_LOCKS * LED_CAL_SAMPLES * (LED_LOCK_WAIT + LED_CAL_TIMEOUT))
+ */
+
 
 /* Define how many bits the messaging system will use. Higher values will
  * allow more unique messages to be defines, but higher values will also
@@ -62,18 +110,266 @@
  */
 #define LED_CMD_BITS 3
 
+/* Define to add commands for the optional trackball features: SET_ACCEL
+ * picks an acceleration curve and SET_FINE turns precision mode on and
+ * off. Every device must be built with the same settings. Without
+ * LED_CMD_ARGS, the first of them takes the code ACT_SET_DPI would
+ * have, so it still fits in 3 bits. Any more need LED_CMD_BITS of 4,
+ * which makes every fixed length command about 40% slower, unless
+ * LED_CMD_HUFFMAN keeps the common commands short.
+#define LED_CMD_SET_ACCEL
+#define LED_CMD_SET_FINE
+ */
+
+/* Define to send one bit with every single lock toggle, rather than
+ * toggling a lock twice for each bit. After the last bit, up to two
+ * closing toggles put num lock and caps lock back in the states they
+ * started in. This roughly halves the time a command takes, but every
+ * device must be built with the same setting.
+#define LED_EDGE_CODING
+ */
+
+/* Define to also send commands with scroll lock, which nobody types
+ * with. Each toggled lock then sends a base-3 digit instead of a bit,
+ * so commands need fewer toggles (3 bits take 2 digits, 8 bits take 6)
+ * and caps lock and num lock are left in the wrong state for less
+ * time. Scroll lock also becomes the default LED_FRAME_START_BIT. Every
+ * device must be built with the same setting, and the host must have a
+ * scroll lock LED, which some operating systems don't track.
+#define LED_SCROLL_LOCK_CODING
+ */
+
+/* Define to send each command with a variable length, prefix-free code,
+ * rather than always using LED_CMD_BITS. The codes are built when the
+ * device starts from the led_cmd_weights array, which a keymap can
+ * define to give the most common commands the fewest symbols, and a
+ * command is received as soon as its last symbol arrives. Every device
+ * must use the same weights. This works best with LED_CMD_FRAMED, as a
+ * short command is otherwise easy to mistake for a stray lock toggle.
+#define LED_CMD_HUFFMAN
+ */
+
+/* Define the most symbols a variable length code can take. Weights that
+ * would give any command a longer code are evened out until they fit.
+#define LED_CMD_MAX_SYMBOLS (2 * LED_CMD_SYMBOLS)
+ */
+
+/* Define to let commands carry a small argument, such as which DPI to
+ * use, so any setting can be reached with one command. The led_cmd_arg_bits
+ * array, set up from LED_CMD_ARG_BITS in led_enum.h, gives how many bits
+ * of argument follow each command, and commands without one are sent as
+ * before. Send a command with send_led_cmd(LED_CMD_WITH_ARG(cmd, arg)),
+ * and process_led_cmd gets LED_CMD_OPCODE(led_cmd) and
+ * LED_CMD_ARG(led_cmd) back. Every device must use the same table.
+#define LED_CMD_ARGS
+ */
+
+/* Define the most bits of argument any command can take. This sets how
+ * long the receive window has to stay open.
+#define LED_ARG_BITS 4
+ */
+
+/* Define to send each command to an address, such as one trackball or
+ * whichever trackball is moving the pointer, instead of to every device.
+ * The address is sent before the command, and a device only processes
+ * commands sent to LED_ADDR_ALL or to an address its led_cmd_addressed
+ * function accepts. Frames for other devices are still decoded to
+ * their end, to know when the next frame can start, and only skip
+ * process_led_cmd. Send a command with
+ * send_led_cmd(LED_CMD_TO(addr, led_cmd)); commands sent without one go
+ * to every device. The addresses are in led_enum.h, and every device
+ * must be built with the same setting.
+#define LED_CMD_ADDRESS
+ */
+
+/* Define how many bits the address takes, which sets how many
+ * addresses there can be.
+#define LED_ADDR_BITS 3
+ */
+
+
+/* Define to frame each command with a start symbol and a known end. Every
+ * frame starts by toggling the lock for LED_FRAME_START_BIT, so stray
+ * toggles of the other locks never open a receive window. A frame ends
+ * once all of its symbols have been sent and the locks are back in their
+ * starting states, so the receive and send windows close right away
+ * instead of waiting for LED_CMD_TIMEOUT and LED_CMD_SELF_WAIT, which
+ * then only apply when part of a frame is lost. This costs one extra
+ * symbol per command.
+#define LED_CMD_FRAMED
+ */
+
+/* Define which lock starts a frame. Num lock is the default, as it is
+ * less likely to affect typing while a command is sent, or scroll lock
+ * with LED_SCROLL_LOCK_CODING.
+#define LED_FRAME_START_BIT NUM_LOCK_BIT
+ */
+
+
+/* Define how many check bits follow each command and its argument. They
+ * are a CRC of the command, so a frame with a lost or extra toggle is
+ * dropped instead of being processed as the wrong command. One bit is
+ * plain parity, and 3 or more also catch most errors in several bits.
+#define LED_CHECK_BITS 3
+ */
+
+/* Define the CRC polynomial for the check bits, leaving out the top bit.
+ * The default suits the width of LED_CHECK_BITS.
+#define LED_CHECK_POLY 0x03
+ */
+
+/* Define to let a receiver that loses track of a frame, such as after a
+ * lost or stray toggle, find the next one instead of ignoring the locks
+ * until LED_CMD_TIMEOUT. The receive window closes once the locks go
+ * quiet for LED_RCV_QUIET. With LED_CHECK_BITS, the receiver also looks
+ * for a frame that started partway through the one it dropped, and
+ * starts a new frame as soon as the locks are back at rest, trusting
+ * the check bits to weed out any that aren't real. led_rcv_counts gives
+ * how often each happens.
+#define LED_RCV_RESYNC
+ */
+
+/* Define to have a receiver acknowledge each command it processes by
+ * toggling LED_ACK_BIT on and off once the frame is over. The sender
+ * waits for the acknowledgement before sending its next command, and
+ * sends the command again if none arrives, waiting twice as long each
+ * time. Only one device should acknowledge each command, which it does
+ * by returning true from process_led_cmd, as both toggling the same lock
+ * at once cancels out. A sequence bit in each frame lets receivers
+ * acknowledge a command sent again without processing it twice. This
+ * needs LED_CMD_FRAMED, and works best with LED_CHECK_BITS.
+#define LED_CMD_ACK
+ */
+
+/* Define which lock acknowledges commands. It must not be the
+ * LED_FRAME_START_BIT, so the default is caps lock when frames start
+ * with num lock, and num lock otherwise.
+#define LED_ACK_BIT CAPS_LOCK_BIT
+ */
+
+/* Define how long a receive window stays open once the locks stop
+ * changing, with LED_CMD_ACK or LED_RCV_RESYNC. A frame that was cut
+ * short is dropped after this time, so the receiver is ready when it
+ * is sent again. This must be longer than the gap between two toggles
+ * of a frame.
+#define LED_RCV_QUIET (LED_TOGGLE_TIME + 50)
+ */
+
+/* Define how long to wait for an acknowledgement after the last toggle
+ * of a command, and how many times to send a command again before
+ * giving up. The wait doubles with each retry.
+#define LED_ACK_TIMEOUT (LED_RCV_QUIET + 50)
+#define LED_CMD_RETRIES 3
+ */
+
+/* Define how long a receiver remembers the last command it processed,
+ * to tell a retry from a new command. The sequence bit doesn't say who
+ * sent a frame, so this is kept to the longest gap between retries, and
+ * the memory is also cleared by any other frame sent or received.
+#define LED_ACK_FORGET ((LED_ACK_TIMEOUT << LED_CMD_RETRIES) + (2 * LED_CMD_TIMEOUT))
+ */
+
+/* Define to let a device that is sending notice when another device
+ * toggles a lock at the same time. The sender watches each echo of the
+ * lock state for a change it didn't make, and when it sees one it stops,
+ * puts back the locks it toggled and sends the command again after a
+ * random backoff that doubles with each collision in a row. This works
+ * with or without LED_CMD_ACK, but frames are only safe from the damage
+ * a collision does with LED_CHECK_BITS.
+#define LED_COLLISION_DETECT
+ */
+
+/* Define a number that is different on every device. Each device waits
+ * at least LED_DEVICE_ID + 1 backoff steps, so two devices that collide
+ * never pick the same time. config.h gives each trackball its own ID.
+#define LED_DEVICE_ID 0
+ */
+
+/* Define the length of one backoff step, and how many collisions in a
+ * row a command can have before it is dropped.
+#define LED_BACKOFF_WAIT LED_TOGGLE_TIME
+#define LED_COLLISION_RETRIES 4
+ */
+
 
 /* Define how long QMK waits for the command to finish after receiving the
  * first LED change. Any extra LED changes after a command has been
- * completed will be ignored until this time has passed.
-#define LED_CMD_TIMEOUT (2 * (LED_CAPS_WAIT + LED_BETWEEN_WAIT) * LED_CMD_BITS + 100)
+ * completed will be ignored until this time has passed. LED_TOGGLE_TIME
+ * is the longest lock wait plus LED_BETWEEN_WAIT, and LED_CMD_TOGGLES is
+ * how many toggles the longest frame takes. Unless LED_CMD_ACK or
+ * LED_RCV_RESYNC keeps the window open, the build stops if this is too
+ * short for the longest frame to arrive.
+#define LED_CMD_TIMEOUT ((LED_TOGGLE_TIME * LED_CMD_TOGGLES) + 100)
  */
 #define LED_CMD_TIMEOUT 1200
 
+/* Define how many outgoing commands can wait to be sent. Commands are
+ * sent in the order they were queued, and any sent while the queue is
+ * full are dropped.
+#define LED_CMD_QUEUE_SIZE 8
+ */
+
 /* When a given device is sending a command, it ignores any LED changes.
  * This value determines how long QMK continues to ignore LED changes
  * after finishing sending a command. Additional commands will also wait
- * until this window closes before being sent.
-#define LED_CMD_SELF_WAIT (LED_CMD_TIMEOUT - (2 * (LED_CAPS_WAIT + LED_BETWEEN_WAIT) * LED_CMD_BITS) + 100)
+ * until this window closes before being sent. Without LED_CMD_FRAMED,
+ * the build stops if the shortest frame plus this wait is less than
+ * LED_CMD_TIMEOUT, which with LED_CMD_HUFFMAN needs a longer wait.
+#define LED_CMD_SELF_WAIT (LED_CMD_TIMEOUT - (LED_TOGGLE_TIME * LED_FRAME_TOGGLES(LED_FRAME_MIN_SYMBOLS)) + 100)
  */
 #define LED_CMD_SELF_WAIT 1000
+
+
+/* Define to keep counts of commands sent, received and dropped, and
+ * histograms of how long sending, receive windows and delivery take.
+ * led_cmd_stats() returns them, and led_cmd_stats_dump() prints them to
+ * the console, so the timings in this file can be tuned from real use.
+#define LED_CMD_STATS
+ */
+
+/* Define the upper end of the first histogram bucket in ms, with each
+ * bucket after it twice as long, and how often in ms every device
+ * prints its statistics, or 0 to only print them on request.
+#define LED_STATS_FIRST_BUCKET 16
+#define LED_STATS_INTERVAL 0
+ */
+
+/* Define to keep console messages in a small ring buffer as binary
+ * events, instead of formatting and printing them while the locks are
+ * being toggled. They are printed in compact form once no command is
+ * being sent or received, and sim/led_log_decode turns them back into
+ * messages. Needs CONSOLE_ENABLE.
+#define LED_CMD_LOG
+ */
+
+/* Define how many events the log holds, up to 255, which costs 7 bytes
+ * of RAM each on AVR and 8 on ARM, and how often in ms it is printed
+ * and how many events at a time. Events logged while it is full are
+ * counted and reported once it has been printed.
+#define LED_LOG_SIZE 16
+#define LED_LOG_DRAIN 20
+#define LED_LOG_BATCH 4
+ */
+
+/* Define to log every LED state the device sees as well, so a misfire
+ * can be replayed with sim/led_replay. A frame can have dozens of
+ * toggles, so LED_LOG_SIZE needs to be raised to 64 or so to not lose
+ * any. Needs LED_CMD_LOG.
+#define LED_LOG_LOCKS
+ */
+
+/* Define to send commands as raw HID reports through relay/led_relay
+ * on the host while it is running, which takes a few ms instead of a
+ * frame of lock toggles. Commands the relay doesn't acknowledge are
+ * sent with the locks instead, so nothing is lost when it isn't
+ * running. Needs RAW_ENABLE = yes in rules.mk on every device, and a
+ * raw_hid_receive in the keymap that calls led_raw_receive.
+#define LED_CMD_RAW_HID
+ */
+
+/* Define how long in ms to wait for the relay to acknowledge a command
+ * before sending it with the locks, and how often in ms a device with
+ * no relay checks for one when sending a command.
+#define LED_RAW_ACK_WAIT 100
+#define LED_RAW_PING_WAIT 1000
+ */
@@ -18,21 +18,125 @@
 #pragma once
 
 
-/* This enum defines the different commands. As noted above, if the
- * caps lock and num lock delays differ, then some commands will be
- * faster than others.
+/* This table defines the different commands, one per line, as
+ * X(name, code, weight, argument bits). Everything else about the
+ * commands is generated from it: the led_cmd_t enum, LED_CMD_WEIGHTS,
+ * LED_CMD_ARG_BITS and the names in LED_CMD_NAMES. features/led_comm.h
+ * checks at compile time that every code fits in LED_CMD_BITS and that
+ * no two commands share a code, and keymap.c dispatches each command
+ * to the handler named after it. As noted above, if the caps lock and
+ * num lock delays differ, then some commands will be faster than
+ * others. Command names must not be the same as a keycode.
  *
- * While it's not required to define the manual binary value for
- * each command, keep in mind that no more than 2^(LED_CMD_BITS)
- * values can be used
+ * The weight gives how often each command is sent, relative to the
+ * others. With LED_CMD_HUFFMAN, this is used to give the most common
+ * commands the fewest symbols. Swapping hands is by far the most
+ * common, while a reset is almost never needed. Commands with a weight
+ * of zero are never sent, and don't take up a code.
+ *
+ * The argument bits give how many bits of argument each command takes
+ * with LED_CMD_ARGS. The argument of ACT_SET_DPI is an index into
+ * PLOOPY_DPI_OPTIONS, so any DPI can be set with one command. It can
+ * be sent with, for example, send_led_cmd(LED_CMD_WITH_ARG(ACT_SET_DPI, 2)).
+ * Without LED_CMD_ARGS it would only repeat one of the other DPI
+ * commands, so it is left out of the table and its code is free.
+ * The argument of SET_ACCEL picks one of the acceleration curves in
+ * keymap.c, and without LED_CMD_ARGS it moves on to the next curve. It
+ * is only in the table with LED_CMD_SET_ACCEL in led_config.h.
+ * SET_FINE turns precision mode on with an argument of 1 and off with
+ * 0, and without LED_CMD_ARGS turns it on if it is off and off if it
+ * is on. It is only in the table with LED_CMD_SET_FINE.
  */
 
+/* Commands that only make sense with an argument, so they don't use up
+ * a code without LED_CMD_ARGS */
+#ifdef LED_CMD_ARGS
+#define LED_CMD_ARG_ROWS(X)                                                 \
+    X(ACT_SET_DPI,  0b011,   5, 2)  /* Set active mouse to DPI option   */
+#else
+#define LED_CMD_ARG_ROWS(X)
+#endif
+
+/* Commands for optional features, turned on in led_config.h, take the
+ * codes the table leaves free, in order: the code of ACT_SET_DPI when
+ * it isn't used, and then those past 3 bits, which need LED_CMD_BITS
+ * of at least 4. */
+#ifdef LED_CMD_ARGS
+#define LED_CMD_SPARE(n) (0b1000 + (n))
+#else
+#define LED_CMD_SPARE(n) (((n) == 0) ? 0b011 : (0b0111 + (n)))
+#endif
+
+#ifdef LED_CMD_SET_ACCEL
+#define LED_CMD_ACCEL_ROWS(X)                                               \
+    X(SET_ACCEL,    LED_CMD_SPARE(0), 5, 2) /* Set acceleration on all mice */
+#define LED_CMD_ACCEL_SPARES 1
+#else
+#define LED_CMD_ACCEL_ROWS(X)
+#define LED_CMD_ACCEL_SPARES 0
+#endif
+
+#ifdef LED_CMD_SET_FINE
+#define LED_CMD_FINE_ROWS(X)                                                \
+    X(SET_FINE,     LED_CMD_SPARE(LED_CMD_ACCEL_SPARES), 5, 1)  /* Set precision mode on all mice */
+#else
+#define LED_CMD_FINE_ROWS(X)
+#endif
+
+#define LED_CMD_TABLE(X)                                                    \
+    X(LFT_MOUSE,    0b000,  40, 0)  /* Activate left mouse              */  \
+    X(RGT_MOUSE,    0b001,  40, 0)  /* Activate right mouse             */  \
+    X(CYCLE_DPI,    0b010,   5, 0)  /* Cycle DPI on all mice            */  \
+    LED_CMD_ARG_ROWS(X)                                                     \
+    X(ACT_HI_DPI,   0b100,   5, 0)  /* Set active mouse to high DPI     */  \
+    X(ACT_MID_DPI,  0b101,   5, 0)  /* Set active mouse to mid DPI      */  \
+    X(ACT_LOW_DPI,  0b110,   5, 0)  /* Set active mouse to low DPI      */  \
+    X(ACT_RESET,    0b111,   1, 0)  /* Reset active mouse               */  \
+    LED_CMD_ACCEL_ROWS(X)                                                   \
+    LED_CMD_FINE_ROWS(X)
+
+#define LED_CMD_ENUM(name, code, weight, arg_bits)      name = code,
+#define LED_CMD_WEIGHT(name, code, weight, arg_bits)    [code] = weight,
+#define LED_CMD_ARG_BIT(name, code, weight, arg_bits)   [code] = arg_bits,
+#define LED_CMD_NAME(name, code, weight, arg_bits)      [code] = #name,
+
 typedef enum {
-    LFT_MOUSE       = 0b000,    /* Activate left mouse              */
-    RGT_MOUSE       = 0b001,    /* Activate right mouse             */
-    CYCLE_DPI       = 0b010,    /* Cycle DPI on all mice            */
-    ACT_HI_DPI      = 0b100,    /* Set active mouse to high DPI     */
-    ACT_MID_DPI     = 0b101,    /* Set active mouse to mid DPI      */
-    ACT_LOW_DPI     = 0b110,    /* Set active mouse to low DPI      */
-    ACT_RESET       = 0b111     /* Reset active mouse               */
+    LED_CMD_TABLE(LED_CMD_ENUM)
 } led_cmd_t;
+
+#define LED_CMD_WEIGHTS     { LED_CMD_TABLE(LED_CMD_WEIGHT) }
+#define LED_CMD_ARG_BITS    { LED_CMD_TABLE(LED_CMD_ARG_BIT) }
+#define LED_CMD_NAMES       { LED_CMD_TABLE(LED_CMD_NAME) }
+
+
+/* Addresses for LED_CMD_ADDRESS, naming which devices a command is
+ * for. Each device decides which addresses it answers to in
+ * led_cmd_addressed, so a new device can share a role such as
+ * ADDR_MOVE without needing an address of its own. No more than
+ * 2^(LED_ADDR_BITS) values can be used. A command is sent to an
+ * address with, for example, send_led_cmd(LED_CMD_TO(ADDR_MOVE, ACT_HI_DPI)).
+ */
+
+typedef enum {
+    ADDR_ALL        = 0b000,    /* Every device (LED_ADDR_ALL)      */
+    ADDR_LEFT       = 0b001,    /* Left trackball                   */
+    ADDR_RIGHT      = 0b010,    /* Right trackball                  */
+    ADDR_MOVE       = 0b011,    /* Trackball moving the pointer     */
+    ADDR_SCROLL     = 0b100     /* Trackball scrolling              */
+} led_addr_t;
+
+
+/* Console messages from keymap.c, as X(name, format of the arguments),
+ * numbered from LED_LOG_USER. The first argument of each is the mouse
+ * side, 0 for left and 1 for right. sim/led_log_decode uses this to
+ * decode them from the LED_CMD_LOG event log.
+ */
+
+#define LED_LOG_USER_EVENTS(X)                              \
+    X(MOUSE_SCROLL,     " - mouse %d scroll %d")            \
+    X(MOUSE_DPI,        " - mouse %d set to %d")            \
+    X(MOUSE_IGNORED,    " - mouse %d ignoring %d")          \
+    X(MOUSE_RESET,      " - mouse %d resetting")            \
+    X(MOUSE_UNHANDLED,  " - mouse %d unhandled %d")        \
+    X(MOUSE_ACCEL,      " - mouse %d acceleration %d")      \
+    X(MOUSE_FINE,       " - mouse %d precision %d")
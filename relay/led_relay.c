@@ -0,0 +1,237 @@
+/* Copyright 2022 Nick Nimchuk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host relay for LED_CMD_RAW_HID. Every QMK raw HID interface found in
+ * /dev/hidraw* is opened, and each command a device sends is passed
+ * to every other device and then acknowledged. Pings are answered, and
+ * each device is told the relay is running as soon as it is found, so
+ * it stops using the locks. Devices that come and go are picked up
+ * every RELAY_SCAN_MS. Once the relay stops, the devices go back to
+ * the locks on their own. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/hidraw.h>
+#include <sys/ioctl.h>
+
+/* These must match the raw HID report in features/led_comm.h */
+#define LED_RAW_SIZE  32
+#define LED_RAW_MAGIC 0x4C
+
+enum { LED_RAW_MAGIC_AT, LED_RAW_TYPE_AT, LED_RAW_SEQ_AT, LED_RAW_FROM_AT, LED_RAW_CMD_AT };
+enum { LED_RAW_PING, LED_RAW_PONG, LED_RAW_CMD, LED_RAW_ACK };
+
+/* The QMK defaults for RAW_USAGE_PAGE and RAW_USAGE_ID */
+#define RAW_USAGE_PAGE 0xFF60
+#define RAW_USAGE_ID   0x61
+
+#define RELAY_MAX_DEVICES 8
+#define RELAY_SCAN_MS     2000
+
+typedef struct {
+    int  fd;
+    char path[32];
+} relay_device_t;
+
+static relay_device_t devices[RELAY_MAX_DEVICES];
+static int            device_count = 0;
+static bool           verbose = false;
+
+/* Look for the raw HID usage page and usage in a report descriptor.
+ * Both are short items, so the bytes can be matched directly. */
+static bool is_raw_hid(int fd) {
+    struct hidraw_report_descriptor desc;
+    int size = 0;
+    bool page = false;
+
+    if ((ioctl(fd, HIDIOCGRDESCSIZE, &size) < 0) || (size <= 0)) {
+        return false;
+    }
+
+    desc.size = size;
+    if (ioctl(fd, HIDIOCGRDESC, &desc) < 0) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i + 2 < desc.size; i++) {
+        if ((desc.value[i] == 0x06) && (desc.value[i + 1] == (RAW_USAGE_PAGE & 0xFF)) &&
+            (desc.value[i + 2] == (RAW_USAGE_PAGE >> 8))) {
+            page = true;
+        } else if (page && (desc.value[i] == 0x09) && (desc.value[i + 1] == RAW_USAGE_ID)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* hidraw takes the report ID first, which is 0 for QMK */
+static bool send_report(int dev, const uint8_t *data) {
+    uint8_t report[LED_RAW_SIZE + 1] = { 0 };
+
+    memcpy(&report[1], data, LED_RAW_SIZE);
+    if (write(devices[dev].fd, report, sizeof(report)) < 0) {
+        fprintf(stderr, "%s: %s\n", devices[dev].path, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static void close_device(int dev) {
+    if (verbose) {
+        printf("%s: gone\n", devices[dev].path);
+    }
+
+    close(devices[dev].fd);
+    devices[dev] = devices[--device_count];
+}
+
+/* Open every raw HID interface not already open, and tell each new one
+ * the relay is running */
+static void scan_devices(void) {
+    for (int n = 0; (n < 64) && (device_count < RELAY_MAX_DEVICES); n++) {
+        char path[32];
+        bool open_already = false;
+
+        snprintf(path, sizeof(path), "/dev/hidraw%d", n);
+        for (int i = 0; i < device_count; i++) {
+            open_already |= (strcmp(devices[i].path, path) == 0);
+        }
+        if (open_already) {
+            continue;
+        }
+
+        int fd = open(path, O_RDWR | O_NONBLOCK);
+        if (fd < 0) {
+            continue;
+        }
+        if (!is_raw_hid(fd)) {
+            close(fd);
+            continue;
+        }
+
+        relay_device_t *device = &devices[device_count++];
+        uint8_t hello[LED_RAW_SIZE] = { [LED_RAW_MAGIC_AT] = LED_RAW_MAGIC, [LED_RAW_TYPE_AT] = LED_RAW_PONG };
+
+        device->fd = fd;
+        strcpy(device->path, path);
+        if (verbose) {
+            printf("%s: found\n", path);
+        }
+        send_report(device_count - 1, hello);
+    }
+}
+
+static uint32_t now_ms(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t)((now.tv_sec * 1000) + (now.tv_nsec / 1000000));
+}
+
+static void relay_report(int from, uint8_t *data) {
+    if (data[LED_RAW_MAGIC_AT] != LED_RAW_MAGIC) {
+        return;
+    }
+
+    switch (data[LED_RAW_TYPE_AT]) {
+        case LED_RAW_PING:
+            data[LED_RAW_TYPE_AT] = LED_RAW_PONG;
+            send_report(from, data);
+            break;
+
+        case LED_RAW_CMD:
+            if (verbose) {
+                uint32_t led_cmd = 0;
+
+                for (int i = 0; i < 4; i++) {
+                    led_cmd |= (uint32_t)data[LED_RAW_CMD_AT + i] << (8 * i);
+                }
+                printf("%s: device %u sent %u\n", devices[from].path, data[LED_RAW_FROM_AT], led_cmd);
+            }
+
+            /* Only acknowledge a command that reached another device,
+             * so the sender falls back to the locks otherwise */
+            int forwarded = 0;
+
+            for (int i = 0; i < device_count; i++) {
+                if ((i != from) && send_report(i, data)) {
+                    forwarded++;
+                }
+            }
+
+            if (forwarded > 0) {
+                data[LED_RAW_TYPE_AT] = LED_RAW_ACK;
+                send_report(from, data);
+            }
+            break;
+    }
+}
+
+int main(int argc, char **argv) {
+    if ((argc > 1) && (strcmp(argv[1], "-v") == 0)) {
+        verbose = true;
+    } else if (argc > 1) {
+        fprintf(stderr, "usage: %s [-v]\n"
+                        "  -v  print every device found and command passed on\n", argv[0]);
+        return 2;
+    }
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    scan_devices();
+
+    uint32_t scan_time = now_ms();
+
+    for (;;) {
+        struct pollfd fds[RELAY_MAX_DEVICES];
+
+        for (int i = 0; i < device_count; i++) {
+            fds[i] = (struct pollfd){ .fd = devices[i].fd, .events = POLLIN };
+        }
+
+        int ready = poll(fds, device_count, RELAY_SCAN_MS);
+        if ((ready < 0) && (errno != EINTR)) {
+            perror("poll");
+            return 1;
+        }
+
+        /* Go backwards, so closing a device doesn't skip another */
+        for (int i = device_count - 1; (ready > 0) && (i >= 0); i--) {
+            uint8_t data[LED_RAW_SIZE];
+
+            if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                close_device(i);
+            } else if ((fds[i].revents & POLLIN) &&
+                       (read(devices[i].fd, data, sizeof(data)) == LED_RAW_SIZE)) {
+                relay_report(i, data);
+            }
+        }
+
+        if (now_ms() - scan_time >= RELAY_SCAN_MS) {
+            scan_devices();
+            scan_time = now_ms();
+        }
+    }
+}
@@ -0,0 +1,558 @@
+/* Copyright 2022 Nick Nimchuk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Latency benchmark for the LED communication feature. A simulated
+ * keyboard sends every command in led_enum.h to two simulated
+ * trackballs, and the time from send_led_cmd to process_led_cmd on
+ * each trackball is reported along with the delivery success rate.
+ * Bursts of commands sent at the same moment show how quickly the
+ * channel can be reused, and whether commands arrive in order, while
+ * mashing a TMP_HDPI style key shows how long the last setting takes
+ * to arrive when commands are queued faster than they can be sent.
+ * Finally, the keyboard and a trackball send at the same moment, which
+ * shows whether both commands survive the collision. */
+
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim_host.h"
+#include "led_enum.h"
+#include "features/led_comm.h"
+
+#define BENCH_TRIAL_LIMIT 30000
+
+typedef struct {
+    uintptr_t   led_cmd;
+    const char *name;
+} bench_cmd_t;
+
+/* Every command in LED_CMD_TABLE, then a few with arguments and
+ * addresses */
+#define BENCH_CMD(name, code, weight, arg_bits) { name, #name },
+
+static const bench_cmd_t bench_cmds[] = {
+    LED_CMD_TABLE(BENCH_CMD)
+#   ifdef LED_CMD_ARGS
+    { LED_CMD_WITH_ARG(ACT_SET_DPI, 0), "SET_DPI 0" },
+    { LED_CMD_WITH_ARG(ACT_SET_DPI, 2), "SET_DPI 2" },
+#   endif
+#   ifdef LED_CMD_ADDRESS
+    { LED_CMD_TO(ADDR_LEFT, CYCLE_DPI),  "CYCLE left"  },
+    { LED_CMD_TO(ADDR_MOVE, ACT_HI_DPI), "HI_DPI move" },
+#   endif
+};
+
+#define BENCH_CMD_COUNT (sizeof(bench_cmds) / sizeof(bench_cmds[0]))
+
+/* Order of commands in a burst. No two neighbours replace or undo each
+ * other, so the send queue has nothing to coalesce. */
+static const uintptr_t bench_burst_cmds[] = {
+    LFT_MOUSE, ACT_HI_DPI, CYCLE_DPI, RGT_MOUSE, ACT_LOW_DPI, ACT_RESET, ACT_MID_DPI
+};
+
+#define BENCH_BURST_CMD_COUNT (sizeof(bench_burst_cmds) / sizeof(bench_burst_cmds[0]))
+
+#define BENCH_MAX_BURST 32
+
+/* Time between key events when mashing a TMP_HDPI style key */
+#define BENCH_MASH_SPACING 40
+
+/* With collision detection, the least share of duplex trials that must
+ * get both commands through when the host drops nothing, in percent.
+ * Below this, the backoff isn't separating the senders. */
+#define BENCH_DUPLEX_MIN 50
+
+/* Commands sent at the same moment by the keyboard and by the left
+ * trackball, such as one asking the keyboard for a mouse layer */
+#define BENCH_DUPLEX_KEYBOARD_CMD  ACT_HI_DPI
+#define BENCH_DUPLEX_TRACKBALL_CMD CYCLE_DPI
+
+typedef enum {
+    ROW_COMMAND,    /* One command at a time                            */
+    ROW_BURST,      /* Several different commands sent at once          */
+    ROW_MASH,       /* ACT_HI_DPI and ACT_MID_DPI alternating quickly   */
+    ROW_DUPLEX      /* Keyboard and trackball sending at the same time  */
+} bench_row_t;
+
+/* State of the trial in progress, updated from the command callback.
+ * A trial sends one or more commands at the same moment, and each
+ * receiver should process all of them once, in order. */
+typedef struct {
+    uint8_t   sender;
+    uint8_t   duplex_sender;
+    uint8_t   duplex_received[SIM_MAX_DEVICES];
+    uintptr_t expected[BENCH_MAX_BURST];
+    uint8_t   expected_count;
+    bool      final_only;
+    uint32_t  sent_time;
+    uint32_t  latency[SIM_MAX_DEVICES];
+    uint8_t   received[SIM_MAX_DEVICES];
+    uint8_t   wrong[SIM_MAX_DEVICES];
+    uintptr_t last[SIM_MAX_DEVICES];
+} trial_t;
+
+/* When mashing, commands may be coalesced, so only the last command
+ * received is checked. Otherwise every command must arrive in order. */
+static void on_command(uint8_t dev, uintptr_t led_cmd, void *ctx) {
+    trial_t *trial = (trial_t *)ctx;
+
+    /* In a duplex trial, the trackball's command is counted apart */
+    if ((trial->duplex_sender != 0) && (led_cmd == BENCH_DUPLEX_TRACKBALL_CMD)) {
+        trial->duplex_received[dev]++;
+        return;
+    }
+
+    uint8_t index = trial->received[dev]++;
+
+    if (dev == trial->sender) {
+        return;
+    }
+
+    trial->last[dev]    = led_cmd;
+    trial->latency[dev] = sim_now() - trial->sent_time;
+
+    if (!trial->final_only &&
+        ((index >= trial->expected_count) || (led_cmd != trial->expected[index]))) {
+        trial->wrong[dev]++;
+    }
+}
+
+/* Results for one row of the report */
+typedef struct {
+    uint32_t *latencies;
+    uint32_t *busy;
+    uint32_t  delivered;
+    uint32_t  checks;
+    uint32_t  ok;
+    uint32_t  wrong;
+} bench_result_t;
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of a sorted sample */
+static uint32_t percentile(const uint32_t *sorted, uint32_t count, uint32_t pct) {
+    if (count == 0) {
+        return 0;
+    }
+
+    uint32_t rank = (pct * count + 99) / 100;
+    return sorted[(rank > 0) ? rank - 1 : 0];
+}
+
+#ifdef LED_CMD_STATS
+static void print_histogram(const char *device, const char *name, const led_stats_histogram_t *histogram) {
+    char label[20];
+
+    snprintf(label, sizeof(label), "%s %s", device, name);
+    printf("%-17s", label);
+
+    for (uint8_t bucket = 0; bucket < LED_STATS_BUCKETS; bucket++) {
+        printf(" %6u", histogram->counts[bucket]);
+    }
+    printf(" %6u\n", histogram->max);
+}
+#endif
+
+/* Print the worst case from the timing model in led_comm.h for every
+ * command, using the codes the given device has built. No command can
+ * start while the channel is busy, which limits how many can be sent
+ * each second. With echo clocking, the best case is printed as well. */
+static void print_timing_model(uint8_t dev) {
+    printf("toggle %d ms  longest frame %d symbols, %d toggles, %d ms  "
+           "LED_CMD_TIMEOUT %d  LED_CMD_SELF_WAIT %d\n\n",
+           LED_TOGGLE_TIME, LED_FRAME_SYMBOLS, LED_CMD_TOGGLES,
+           LED_FRAME_SEND_TIME(LED_FRAME_SYMBOLS), LED_CMD_TIMEOUT, LED_CMD_SELF_WAIT);
+    printf("%-12s %4s %7s %7s %10s %7s %7s %8s",
+           "command", "code", "symbols", "toggles", "latency ms", "send ms", "busy ms", "per sec");
+#   ifdef LED_ECHO_CLOCK
+    printf(" %8s %8s", "min send", "min busy");
+#   endif
+    printf("\n");
+
+    for (size_t c = 0; c < BENCH_CMD_COUNT; c++) {
+        uint8_t symbols = sim_frame_symbols(dev, bench_cmds[c].led_cmd);
+
+        printf("%-12s %4lu", bench_cmds[c].name, (unsigned long)bench_cmds[c].led_cmd);
+
+        if (symbols == 0) {
+            printf(" %7s\n", "no code");
+            continue;
+        }
+
+        printf(" %7u %7u %10u %7u %7u %8.2f", symbols, LED_FRAME_TOGGLES(symbols),
+               LED_FRAME_LATENCY(symbols), LED_FRAME_SEND_TIME(symbols),
+               LED_FRAME_BUSY_TIME(symbols), 1000.0 / LED_FRAME_BUSY_TIME(symbols));
+#       ifdef LED_ECHO_CLOCK
+        printf(" %8u %8u", LED_FRAME_MIN_SEND_TIME(symbols), LED_FRAME_MIN_BUSY_TIME(symbols));
+#       endif
+        printf("\n");
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -n TRIALS   trials per command (default 200)\n"
+        "  -b COUNT    commands sent back-to-back in each burst, 0 to skip (default 4)\n"
+        "  -m COUNT    key events in each TMP_HDPI mash, 0 to skip (default 8)\n"
+        "  -x          skip the duplex row\n"
+        "  -F PCT      fail if the duplex row succeeds less often than PCT percent\n"
+        "              (default %d with LED_COLLISION_DETECT and no dropped reports)\n"
+        "  -t          print the worst case timing of each command and exit\n"
+        "  -k MS       key event latency to the host (default 1)\n"
+        "  -l MS       LED report latency to each device (default 1)\n"
+        "  -j MS       extra random host jitter, 0 to MS (default 0)\n"
+        "  -d PCT      percentage of LED reports dropped (default 0)\n"
+        "  -H MS       minimum hold for the host to accept a lock key (default 0)\n"
+        "  -R MS       run the raw HID relay from MS on (LED_CMD_RAW_HID)\n"
+        "  -Q MS       stop the raw HID relay at MS\n"
+        "  -s SEED     random seed (default 1)\n"
+        "  -D PATH     simulated device library (default sim_device.so next to this program)\n"
+        "  -T FILE     write the LED states the left trackball sees to FILE, for led_replay\n"
+        "  -v          print device console output\n",
+        prog, BENCH_DUPLEX_MIN);
+}
+
+int main(int argc, char **argv) {
+    sim_params_t params = SIM_PARAMS_DEFAULT;
+    uint32_t     trials = 200;
+    uint32_t     burst_count = 4;
+    uint32_t     mash_count = 8;
+    bool         duplex = true;
+    double       duplex_min = -1.0;
+    bool         failed = false;
+    bool         timing_model = false;
+    const char  *trace_path = NULL;
+    char         device_path[PATH_MAX];
+    char         self_path[PATH_MAX];
+    int          opt;
+
+    strncpy(self_path, argv[0], sizeof(self_path) - 1);
+    self_path[sizeof(self_path) - 1] = '\0';
+    snprintf(device_path, sizeof(device_path), "%s/sim_device.so", dirname(self_path));
+
+    while ((opt = getopt(argc, argv, "n:b:m:xF:tk:l:j:d:H:R:Q:s:D:T:vh")) != -1) {
+        switch (opt) {
+            case 'n': trials             = strtoul(optarg, NULL, 0); break;
+            case 'b': burst_count        = strtoul(optarg, NULL, 0); break;
+            case 'm': mash_count         = strtoul(optarg, NULL, 0); break;
+            case 'x': duplex             = false; break;
+            case 'F': duplex_min         = strtod(optarg, NULL); break;
+            case 't': timing_model       = true; break;
+            case 'k': params.key_latency = strtoul(optarg, NULL, 0); break;
+            case 'l': params.led_latency = strtoul(optarg, NULL, 0); break;
+            case 'j': params.jitter      = strtoul(optarg, NULL, 0); break;
+            case 'd': params.drop_rate   = strtod(optarg, NULL) / 100.0; break;
+            case 'H': params.min_hold    = strtoul(optarg, NULL, 0); break;
+            case 'R':
+                params.relay       = true;
+                params.relay_start = strtoul(optarg, NULL, 0);
+                break;
+            case 'Q': params.relay_stop  = strtoul(optarg, NULL, 0); break;
+            case 's': params.seed        = strtoull(optarg, NULL, 0); break;
+            case 'D':
+                strncpy(device_path, optarg, sizeof(device_path) - 1);
+                device_path[sizeof(device_path) - 1] = '\0';
+                break;
+            case 'T': trace_path         = optarg; break;
+            case 'v': params.verbose     = true; break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 2;
+        }
+    }
+
+    if ((trials == 0) || (burst_count > BENCH_MAX_BURST) || (mash_count > BENCH_MAX_BURST)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+#   ifdef LED_COLLISION_DETECT
+    if ((duplex_min < 0.0) && (params.drop_rate == 0.0)) {
+        duplex_min = BENCH_DUPLEX_MIN;
+    }
+#   endif
+
+    trial_t trial;
+
+    sim_init(&params, device_path);
+    sim_set_command_cb(on_command, &trial);
+
+    uint8_t keyboard = sim_add_device("keyboard");
+    uint8_t left     = sim_add_device("left");
+    uint8_t right    = sim_add_device("right");
+    uint8_t receivers[] = { left, right };
+
+    if (timing_model) {
+        print_timing_model(keyboard);
+        return 0;
+    }
+
+    if (trace_path) {
+        FILE *trace = fopen(trace_path, "w");
+
+        if (!trace) {
+            perror(trace_path);
+            return 1;
+        }
+        sim_set_trace(trace, left);
+    }
+
+    bench_result_t result = {
+        .latencies = calloc(trials * sizeof(receivers), sizeof(uint32_t)),
+        .busy      = calloc(trials, sizeof(uint32_t))
+    };
+    if (!result.latencies || !result.busy) {
+        return 1;
+    }
+
+    printf("LED_NUM_WAIT %d  LED_CAPS_WAIT %d  LED_BETWEEN_WAIT %d  LED_CMD_BITS %d  "
+           "LED_CMD_TIMEOUT %d  LED_CMD_SELF_WAIT %d\n",
+           LED_NUM_WAIT, LED_CAPS_WAIT, LED_BETWEEN_WAIT, LED_CMD_BITS,
+           LED_CMD_TIMEOUT, LED_CMD_SELF_WAIT);
+    printf("host: key %u ms, LED %u ms, jitter 0-%u ms, min hold %u ms, drop %.1f%%, "
+           "%u trials, seed %llu\n",
+           params.key_latency, params.led_latency, params.jitter, params.min_hold,
+           params.drop_rate * 100.0, trials, (unsigned long long)params.seed);
+    if (params.relay) {
+        printf("relay: from %u ms", params.relay_start);
+        if (params.relay_stop > 0) {
+            printf(" to %u ms", params.relay_stop);
+        }
+        printf("\n");
+    }
+    printf("\n");
+
+#   ifdef LED_CALIBRATE
+    /* Let every device calibrate for the simulated host first */
+    sim_run_until_idle(BENCH_TRIAL_LIMIT);
+
+    const uint8_t devices[]      = { keyboard, left, right };
+    const char   *device_names[] = { "keyboard", "left", "right" };
+
+    for (size_t d = 0; d < sizeof(devices); d++) {
+        led_timing_t timing = sim_timing(devices[d]);
+
+        printf("calibrated %-8s num %u  caps %u  scroll %u  timeout %u  self wait %u\n",
+               device_names[d], timing.num_wait, timing.caps_wait, timing.scroll_wait,
+               timing.cmd_timeout, timing.self_wait);
+    }
+    printf("\n");
+#   endif
+    printf("%-12s %4s %8s %6s %8s %8s %8s %9s\n",
+           "command", "code", "success", "wrong", "p50 ms", "p99 ms", "max ms", "busy p50");
+
+    /* One row per command, then a row for bursts of back-to-back
+     * commands, which is limited by how soon each one can start, one
+     * for mashing a key that sends a command on press and release, and
+     * one for the keyboard and a trackball sending at the same time. */
+    for (size_t c = 0; c < BENCH_CMD_COUNT + 3; c++) {
+        bench_row_t row = (c < BENCH_CMD_COUNT) ? ROW_COMMAND :
+                          (c == BENCH_CMD_COUNT) ? ROW_BURST :
+                          (c == BENCH_CMD_COUNT + 1) ? ROW_MASH : ROW_DUPLEX;
+
+        if (((row == ROW_BURST) && (burst_count == 0)) ||
+            ((row == ROW_MASH) && (mash_count == 0)) ||
+            ((row == ROW_DUPLEX) && !duplex)) {
+            continue;
+        }
+
+        result.checks    = 0;
+        result.delivered = 0;
+        result.ok        = 0;
+        result.wrong     = 0;
+
+        for (uint32_t t = 0; t < trials; t++) {
+            sim_run_until_idle(BENCH_TRIAL_LIMIT);
+
+            uint32_t start_time = sim_now();
+
+            memset(&trial, 0, sizeof(trial));
+            trial.sender    = keyboard;
+            trial.sent_time = start_time;
+
+            switch (row) {
+                case ROW_COMMAND:
+                    trial.expected[trial.expected_count++] = bench_cmds[c].led_cmd;
+                    sim_send_cmd(keyboard, bench_cmds[c].led_cmd);
+                    break;
+
+                case ROW_BURST:
+                    for (uint8_t i = 0; i < burst_count; i++) {
+                        uintptr_t led_cmd = bench_burst_cmds[(t + i) % BENCH_BURST_CMD_COUNT];
+
+                        trial.expected[trial.expected_count++] = led_cmd;
+                        sim_send_cmd(keyboard, led_cmd);
+                    }
+                    break;
+
+                case ROW_MASH:
+                    /* Latency is measured from the final release */
+                    trial.final_only = true;
+                    for (uint8_t i = 0; i < mash_count; i++) {
+                        uintptr_t led_cmd = (i % 2) ? ACT_MID_DPI : ACT_HI_DPI;
+
+                        sim_run_until(start_time + i * BENCH_MASH_SPACING);
+                        trial.expected[trial.expected_count++] = led_cmd;
+                        trial.sent_time = sim_now();
+                        sim_send_cmd(keyboard, led_cmd);
+                    }
+                    break;
+
+                case ROW_DUPLEX:
+                    trial.duplex_sender = left;
+                    trial.expected[trial.expected_count++] = BENCH_DUPLEX_KEYBOARD_CMD;
+                    sim_send_cmd(keyboard, BENCH_DUPLEX_KEYBOARD_CMD);
+                    sim_send_cmd(left, BENCH_DUPLEX_TRACKBALL_CMD);
+                    break;
+            }
+
+            sim_run_until_idle(BENCH_TRIAL_LIMIT);
+            result.busy[t] = sim_now() - start_time;
+
+            /* The trackball's command must reach the keyboard and the
+             * other trackball once each */
+            if (row == ROW_DUPLEX) {
+                result.checks += 2;
+                result.ok     += (trial.duplex_received[keyboard] == 1);
+                result.ok     += (trial.duplex_received[right] == 1);
+            }
+
+            for (size_t r = 0; r < sizeof(receivers); r++) {
+                uint8_t dev = receivers[r];
+                bool    ok;
+
+                result.checks++;
+
+                /* A command sent to the other trackball must not arrive */
+                if (!sim_addressed(dev, LED_CMD_ADDR(trial.expected[0]))) {
+                    if (trial.received[dev] == 0) {
+                        result.ok++;
+                    }
+                    continue;
+                }
+
+                if (trial.final_only) {
+                    ok = (trial.received[dev] > 0) &&
+                         (trial.last[dev] == trial.expected[trial.expected_count - 1]);
+                } else {
+                    ok = (trial.wrong[dev] == 0) && (trial.received[dev] == trial.expected_count);
+                }
+
+                if (ok) {
+                    result.latencies[result.delivered++] = trial.latency[dev];
+                    result.ok++;
+                }
+                result.wrong += trial.wrong[dev];
+            }
+        }
+
+        qsort(result.latencies, result.delivered, sizeof(uint32_t), compare_u32);
+        qsort(result.busy, trials, sizeof(uint32_t), compare_u32);
+
+        char name[16];
+
+        switch (row) {
+            case ROW_COMMAND:
+                printf("%-12s %4u", bench_cmds[c].name, (unsigned)bench_cmds[c].led_cmd);
+                break;
+
+            case ROW_BURST:
+                snprintf(name, sizeof(name), "burst of %u", burst_count);
+                printf("%-12s %4s", name, "-");
+                break;
+
+            case ROW_MASH:
+                snprintf(name, sizeof(name), "mash of %u", mash_count);
+                printf("%-12s %4s", name, "-");
+                break;
+
+            case ROW_DUPLEX:
+                printf("%-12s %4s", "duplex", "-");
+                break;
+        }
+
+        printf(" %7.1f%% %6u %8u %8u %8u %9u\n",
+               100.0 * result.ok / result.checks, result.wrong,
+               percentile(result.latencies, result.delivered, 50),
+               percentile(result.latencies, result.delivered, 99),
+               result.delivered ? result.latencies[result.delivered - 1] : 0,
+               percentile(result.busy, trials, 50));
+
+        if ((row == ROW_DUPLEX) && (100.0 * result.ok / result.checks < duplex_min)) {
+            fprintf(stderr, "duplex: %.1f%% delivered, expected at least %.1f%%\n",
+                    100.0 * result.ok / result.checks, duplex_min);
+            failed = true;
+        }
+    }
+
+    /* How often the trackballs lost track of a frame over the whole run */
+    led_rcv_counts_t counts = { 0, 0, 0 };
+
+    for (size_t r = 0; r < sizeof(receivers); r++) {
+        led_rcv_counts_t dev_counts = sim_rcv_counts(receivers[r]);
+
+        counts.resyncs += dev_counts.resyncs;
+        counts.drops    += dev_counts.drops;
+        counts.timeouts += dev_counts.timeouts;
+    }
+
+    printf("\ntrackballs: %u frames dropped, %u of them timed out, %u resyncs\n",
+           counts.drops, counts.timeouts, counts.resyncs);
+
+#   ifdef LED_CMD_STATS
+    /* Each device's own view of the run */
+    const uint8_t stats_devices[] = { keyboard, left, right };
+    const char   *stats_names[]   = { "keyboard", "left", "right" };
+
+    printf("\n%-8s %6s %8s %7s %7s %7s\n", "stats", "sent", "received", "dropped", "ignored", "retries");
+
+    for (size_t d = 0; d < sizeof(stats_devices); d++) {
+        led_cmd_stats_t stats = sim_stats(stats_devices[d]);
+
+        printf("%-8s %6u %8u %7u %7u %7u\n", stats_names[d],
+               stats.sent, stats.received, stats.dropped, stats.ignored, stats.retries);
+    }
+
+    printf("\n%-17s", "histogram ms");
+    for (uint8_t bucket = 0; bucket < LED_STATS_BUCKETS - 1; bucket++) {
+        char label[12];
+
+        snprintf(label, sizeof(label), "<%u", LED_STATS_FIRST_BUCKET << bucket);
+        printf(" %6s", label);
+    }
+    printf(" %6s %6s\n", "longer", "max");
+
+    for (size_t d = 0; d < sizeof(stats_devices); d++) {
+        led_cmd_stats_t stats = sim_stats(stats_devices[d]);
+
+        print_histogram(stats_names[d], "send", &stats.send_ms);
+        print_histogram(stats_names[d], "window", &stats.window_ms);
+        print_histogram(stats_names[d], "latency", &stats.latency_ms);
+    }
+#   endif
+
+    free(result.latencies);
+    free(result.busy);
+    return failed ? 1 : 0;
+}
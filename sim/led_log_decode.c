@@ -0,0 +1,112 @@
+/* Copyright 2022 Nick Nimchuk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Decoder for the LED_CMD_LOG event log. Console output, such as from
+ * hid_listen or led_bench -v, is read from stdin, and every
+ * "LED_LOG <event> <time> <arg0> <arg1>" record is replaced with the
+ * message it stands for, after the time it was logged in ms. Every
+ * other line is passed through unchanged. With -l, the event numbers
+ * are listed instead. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "led_enum.h"
+#include "features/led_comm.h"
+
+static const char *const event_names[] = {
+#   define EVENT_NAME(name, format) #name,
+    LED_LOG_EVENTS(EVENT_NAME)
+};
+
+static const char *const event_formats[] = { LED_LOG_EVENTS(LED_LOG_FORMAT) };
+
+static const char *const user_names[] = {
+    LED_LOG_USER_EVENTS(EVENT_NAME)
+#   undef EVENT_NAME
+};
+
+static const char *const user_formats[] = { LED_LOG_USER_EVENTS(LED_LOG_FORMAT) };
+
+#define COUNT(array) (sizeof(array) / sizeof((array)[0]))
+
+/* Only the low 16 bits of the time are logged, so pick the full time
+ * closest to the last one seen */
+static uint32_t unwrap_time(uint16_t time) {
+    static uint32_t last = 0;
+    uint32_t full = (last & ~0xFFFFu) | time;
+
+    if ((full + 0x8000u) < last) {
+        full += 0x10000u;
+    } else if ((full > (last + 0x8000u)) && (full >= 0x10000u)) {
+        full -= 0x10000u;
+    }
+
+    last = full;
+    return full;
+}
+
+static void decode(const char *line, const char *record) {
+    unsigned event, time, arg0, arg1;
+
+    if (sscanf(record, "LED_LOG %x %x %x %x", &event, &time, &arg0, &arg1) != 4) {
+        fputs(line, stdout);
+        return;
+    }
+
+    /* Keep whatever came before the record, such as a device name */
+    fwrite(line, 1, record - line, stdout);
+    printf("@%-7u ", unwrap_time(time));
+
+    if (event < COUNT(event_formats)) {
+        printf(event_formats[event], arg0, arg1);
+    } else if ((event >= LED_LOG_USER) && (event - LED_LOG_USER < COUNT(user_formats))) {
+        printf(user_formats[event - LED_LOG_USER], arg0, arg1);
+    } else {
+        printf("UNKNOWN_EVENT %u: %u %u\n", event, arg0, arg1);
+    }
+}
+
+int main(int argc, char **argv) {
+    char line[512];
+
+    if ((argc > 1) && (strcmp(argv[1], "-l") == 0)) {
+        /* List the events, as a reference for reading raw logs */
+        for (size_t i = 0; i < COUNT(event_names); i++) {
+            printf("%3zx %s\n", i, event_names[i]);
+        }
+        for (size_t i = 0; i < COUNT(user_names); i++) {
+            printf("%3zx %s\n", LED_LOG_USER + i, user_names[i]);
+        }
+        return 0;
+    } else if (argc > 1) {
+        fprintf(stderr, "usage: %s [-l] < console output\n"
+                        "  -l  list the event numbers\n", argv[0]);
+        return 2;
+    }
+
+    while (fgets(line, sizeof(line), stdin)) {
+        const char *record = strstr(line, "LED_LOG ");
+
+        if (record) {
+            decode(line, record);
+        } else {
+            fputs(line, stdout);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,603 @@
+/* Copyright 2022 Nick Nimchuk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Replay and fuzz tool for the LED communication receiver. A trace of
+ * the LED states one device saw is fed through a fresh copy of
+ * sim_device.so (an unmodified features/led_comm.c) at the times they
+ * were seen, and the commands it decodes are printed along with how
+ * many frames it dropped. Traces come from led_bench -T, or from the
+ * console of a device built with LED_LOG_LOCKS after led_log_decode.
+ *
+ * With -f, the trace is replayed many times with random jitter added
+ * to each toggle, so toggles of different locks can swap places, with
+ * LED reports dropped, and with the toggles of a second trace mixed in
+ * at a random offset. Each result is compared to a clean replay of the
+ * trace, and the seed of every schedule that decoded a wrong command
+ * is printed so it can be replayed on its own. */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "sim_api.h"
+
+/* How long to keep running after the last change, so every window and
+ * retry is over */
+#define REPLAY_SETTLE 10000
+
+#define REPLAY_MAX_CMDS  256
+#define REPLAY_MAX_SHOWN 10
+
+typedef struct {
+    uint32_t time;
+    uint8_t  leds;      /* Host LED state, as in led_t */
+} trace_event_t;
+
+typedef struct {
+    trace_event_t *events;
+    uint32_t       count;
+    uint32_t       size;
+} trace_t;
+
+typedef struct {
+    uintptr_t        cmds[REPLAY_MAX_CMDS];
+    uint32_t         cmd_count;
+    uint32_t         presses;   /* Lock keys pressed, such as for acks */
+    led_rcv_counts_t counts;
+} replay_result_t;
+
+static const char *const cmd_names[LED_CMD_COUNT] = LED_CMD_NAMES;
+
+static const char      *device_path;
+static uint8_t          device_id = 1;
+static bool             verbose = false;
+static bool             print_cmds = false;
+static uint32_t         now_ms = 0;
+static replay_result_t *result = NULL;
+static uint64_t         rng_state = 1;
+
+/* xorshift64*, as in sim_host.c */
+static uint32_t replay_random(uint32_t range) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+
+    if (range == 0) {
+        return 0;
+    }
+    return (uint32_t)((rng_state * 0x2545F4914F6CDD1DULL) >> 32) % range;
+}
+
+static void trace_add(trace_t *trace, uint32_t time, uint8_t leds) {
+    if (trace->count == trace->size) {
+        trace->size   = trace->size ? 2 * trace->size : 256;
+        trace->events = realloc(trace->events, trace->size * sizeof(trace_event_t));
+        if (!trace->events) {
+            perror("led_replay");
+            exit(1);
+        }
+    }
+
+    trace->events[trace->count++] = (trace_event_t){ .time = time, .leds = leds };
+}
+
+/* Read a trace. Each line is either the time in ms and the LED state,
+ * as written by led_bench -T, or a line of led_log_decode output with
+ * an LED_LOCKS event. Anything else is skipped, so whole console logs
+ * can be read. The first state read is where the device starts. */
+static bool trace_read(const char *path, trace_t *trace) {
+    FILE    *file = fopen(path, "r");
+    char     line[512];
+    uint32_t lost = 0;
+
+    if (!file) {
+        perror(path);
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        const char *locks = strstr(line, "LED_LOCKS: ");
+        const char *at    = strchr(line, '@');
+        unsigned    time, leds;
+
+        if (locks && at && (sscanf(at, "@%u", &time) == 1) &&
+            (sscanf(locks, "LED_LOCKS: %u", &leds) == 1)) {
+            trace_add(trace, time, leds);
+        } else if (strstr(line, "LED_LOG_LOST")) {
+            lost++;
+        } else if (sscanf(line, "%u %i", &time, &leds) == 2) {
+            trace_add(trace, time, leds);
+        }
+    }
+
+    fclose(file);
+
+    if (lost > 0) {
+        fprintf(stderr, "%s: the device log lost events %u times, so the trace has gaps\n", path, lost);
+    }
+
+    for (uint32_t i = 1; i < trace->count; i++) {
+        if (trace->events[i].time < trace->events[i - 1].time) {
+            fprintf(stderr, "%s: time goes backwards at %u ms\n", path, trace->events[i].time);
+            return false;
+        }
+    }
+
+    if (trace->count == 0) {
+        fprintf(stderr, "%s: no LED states found\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+static void print_cmd(uint32_t time, uintptr_t led_cmd) {
+    const char *name = cmd_names[LED_CMD_OPCODE(led_cmd)];
+
+    printf("@%-7u ", time);
+
+    if (name) {
+        printf("%s", name);
+    } else {
+        printf("command %lu", (unsigned long)LED_CMD_OPCODE(led_cmd));
+    }
+
+#   ifdef LED_CMD_ARGS
+    printf(" arg %lu", (unsigned long)LED_CMD_ARG(led_cmd));
+#   endif
+#   ifdef LED_CMD_ADDRESS
+    printf(" to %lu", (unsigned long)LED_CMD_ADDR(led_cmd));
+#   endif
+    printf("\n");
+}
+
+/* A change of one or more locks. Replays work on toggles rather than
+ * states, so toggles can be moved, dropped and mixed independently. */
+typedef struct {
+    uint32_t time;
+    uint8_t  mask;
+} toggle_t;
+
+typedef struct {
+    toggle_t *toggles;
+    uint32_t  count;
+    uint8_t   start_leds;
+    uint32_t  start_time;
+} schedule_t;
+
+static void schedule_from_trace(const trace_t *trace, schedule_t *schedule) {
+    schedule->toggles    = malloc(trace->count * sizeof(toggle_t));
+    schedule->count      = 0;
+    schedule->start_leds = trace->events[0].leds;
+    schedule->start_time = trace->events[0].time;
+
+    if (!schedule->toggles) {
+        perror("led_replay");
+        exit(1);
+    }
+
+    for (uint32_t i = 1; i < trace->count; i++) {
+        schedule->toggles[schedule->count++] = (toggle_t){
+            .time = trace->events[i].time,
+            .mask = trace->events[i].leds ^ trace->events[i - 1].leds
+        };
+    }
+}
+
+static void schedule_print(const schedule_t *schedule) {
+    uint8_t leds = schedule->start_leds;
+
+    printf("%u %u\n", schedule->start_time, leds);
+
+    for (uint32_t i = 0; i < schedule->count; i++) {
+        leds ^= schedule->toggles[i].mask;
+
+        if ((i + 1 == schedule->count) || (schedule->toggles[i + 1].time != schedule->toggles[i].time)) {
+            printf("%u %u\n", schedule->toggles[i].time, leds);
+        }
+    }
+}
+
+/* The host reflects lock keys pressed by the device after this long */
+#define REPLAY_ECHO 2
+
+/* Own toggles waiting to be reflected */
+#define REPLAY_MAX_OWN 16
+
+static toggle_t *replay_toggles;
+static uint32_t  replay_count;
+static uint32_t  replay_next;
+static uint32_t  own_times[REPLAY_MAX_OWN];
+static uint8_t   own_masks[REPLAY_MAX_OWN];
+static uint8_t   own_count;
+
+static uint8_t lock_mask(uint8_t keycode) {
+    switch (keycode) {
+        case KC_NUM:  return 1 << 0;
+        case KC_CAPS: return 1 << 1;
+        case KC_SCRL: return 1 << 2;
+        default:      return 0;
+    }
+}
+
+/* Host callbacks */
+
+static uint32_t ops_now(void) {
+    return now_ms;
+}
+
+/* A lock key pressed by the device, such as for an acknowledgement, is
+ * toggled by the host shortly after. If the trace was recorded from
+ * this device, it already has that toggle a little later, so the first
+ * matching toggle within one LED_TOGGLE_TIME is taken to be the echo
+ * and left out. */
+static void ops_key_event(uint8_t dev, uint8_t keycode, bool pressed) {
+    uint8_t mask = lock_mask(keycode);
+
+    if (!pressed || (mask == 0)) {
+        return;
+    }
+
+    result->presses++;
+
+    for (uint32_t i = replay_next; (i < replay_count) &&
+         (replay_toggles[i].time <= now_ms + LED_TOGGLE_TIME); i++) {
+        if (replay_toggles[i].mask & mask) {
+            replay_toggles[i].mask &= ~mask;
+            break;
+        }
+    }
+
+    if (own_count < REPLAY_MAX_OWN) {
+        own_times[own_count]   = now_ms + REPLAY_ECHO;
+        own_masks[own_count++] = mask;
+    }
+}
+
+static void ops_command(uint8_t dev, uintptr_t led_cmd) {
+    if (result->cmd_count < REPLAY_MAX_CMDS) {
+        result->cmds[result->cmd_count] = led_cmd;
+    }
+    result->cmd_count++;
+
+    if (print_cmds) {
+        print_cmd(now_ms, led_cmd);
+    }
+}
+
+static void ops_log(uint8_t dev, const char *fmt, va_list args) {
+    if (verbose) {
+        fprintf(stderr, "%8u ", now_ms);
+        vfprintf(stderr, fmt, args);
+    }
+}
+
+/* Only the lock path is replayed, so there is no relay to answer */
+static void ops_raw_send(uint8_t dev, const uint8_t *data, uint8_t length) {
+}
+
+static const sim_host_ops_t host_ops = {
+    .now       = ops_now,
+    .key_event = ops_key_event,
+    .command   = ops_command,
+    .log       = ops_log,
+    .raw_send  = ops_raw_send
+};
+
+/* Replay a schedule through a freshly loaded device. Like sim_host.c,
+ * each ms first applies the toggles that are due, then passes any new
+ * LED state to the device, and then runs its deferred executor. The
+ * library is unloaded afterwards, so every replay starts from the same
+ * state. The schedule's toggles that turn out to be echoes of the
+ * device's own keys are left out of it. */
+static void replay(schedule_t *schedule, replay_result_t *replay_result) {
+    void *handle = dlopen(device_path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        fprintf(stderr, "led_replay: %s\n", dlerror());
+        exit(1);
+    }
+
+    const sim_device_api_t *api = dlsym(handle, SIM_DEVICE_API);
+    if (!api) {
+        fprintf(stderr, "led_replay: %s\n", dlerror());
+        exit(1);
+    }
+
+    memset(replay_result, 0, sizeof(*replay_result));
+    result         = replay_result;
+    replay_toggles = schedule->toggles;
+    replay_count   = schedule->count;
+    replay_next    = 0;
+    own_count      = 0;
+    now_ms         = schedule->start_time;
+
+    uint8_t  leds = schedule->start_leds;
+    uint8_t  seen = leds;
+    uint32_t end_time = ((schedule->count > 0) ? schedule->toggles[schedule->count - 1].time : now_ms) +
+                        REPLAY_SETTLE;
+
+    api->attach(&host_ops, device_id);
+    api->post_init((led_t){ .raw = leds });
+
+    for (;;) {
+        uint32_t next = api->next_deferred();
+
+        if ((replay_next < replay_count) && (replay_toggles[replay_next].time < next)) {
+            next = replay_toggles[replay_next].time;
+        }
+        for (uint8_t i = 0; i < own_count; i++) {
+            if (own_times[i] < next) {
+                next = own_times[i];
+            }
+        }
+
+        if (next > end_time) {
+            break;
+        }
+        if (next > now_ms) {
+            now_ms = next;
+        }
+
+        while ((replay_next < replay_count) && (replay_toggles[replay_next].time <= now_ms)) {
+            leds ^= replay_toggles[replay_next++].mask;
+        }
+        for (uint8_t i = 0; i < own_count;) {
+            if (own_times[i] <= now_ms) {
+                leds ^= own_masks[i];
+                own_times[i] = own_times[--own_count];
+                own_masks[i] = own_masks[own_count];
+            } else {
+                i++;
+            }
+        }
+
+        if (leds != seen) {
+            seen = leds;
+            api->led_update((led_t){ .raw = leds });
+        }
+
+        api->deferred_task();
+    }
+
+    replay_result->counts = api->rcv_counts();
+    result = NULL;
+    dlclose(handle);
+}
+
+static int compare_toggles(const void *a, const void *b) {
+    const toggle_t *x = (const toggle_t *)a;
+    const toggle_t *y = (const toggle_t *)b;
+    return (x->time > y->time) - (x->time < y->time);
+}
+
+typedef struct {
+    uint32_t jitter;    /* Extra random delay per toggle, 0 to jitter ms */
+    double   drop_rate; /* Chance that an LED report is lost            */
+    const schedule_t *mix;  /* Toggles to mix in at a random offset     */
+} fuzz_params_t;
+
+/* Build a schedule from a clean replay of the trace, leaving out the
+ * device's own echoes, which the replay adds back wherever the device
+ * presses its keys. The other toggles are delayed, mixed with the
+ * other trace and put back in order. A dropped LED report passes its
+ * toggles on to the next one, which is all the device would see. */
+static void fuzz_schedule(const schedule_t *clean, const fuzz_params_t *fuzz, schedule_t *out) {
+    uint32_t mix_count = fuzz->mix ? fuzz->mix->count : 0;
+
+    out->count      = 0;
+    out->start_leds = clean->start_leds;
+    out->start_time = clean->start_time;
+
+    for (uint32_t i = 0; i < clean->count; i++) {
+        if (clean->toggles[i].mask != 0) {
+            out->toggles[out->count++] = (toggle_t){
+                .time = clean->toggles[i].time + replay_random(fuzz->jitter + 1),
+                .mask = clean->toggles[i].mask
+            };
+        }
+    }
+
+    if (mix_count > 0) {
+        uint32_t span   = (clean->count > 0) ? clean->toggles[clean->count - 1].time - clean->start_time : 0;
+        uint32_t offset = clean->start_time + replay_random(span + 1);
+
+        for (uint32_t i = 0; i < mix_count; i++) {
+            out->toggles[out->count++] = (toggle_t){
+                .time = offset + (fuzz->mix->toggles[i].time - fuzz->mix->start_time),
+                .mask = fuzz->mix->toggles[i].mask
+            };
+        }
+    }
+
+    qsort(out->toggles, out->count, sizeof(toggle_t), compare_toggles);
+
+    for (uint32_t i = 0; i + 1 < out->count; i++) {
+        if (replay_random(1000000) < (uint32_t)(fuzz->drop_rate * 1000000.0)) {
+            out->toggles[i + 1].mask ^= out->toggles[i].mask;
+            out->toggles[i].mask = 0;
+        }
+    }
+}
+
+typedef enum {
+    FUZZ_SAME,      /* The same commands as the clean replay            */
+    FUZZ_LOST,      /* Some of them, in order, and nothing else         */
+    FUZZ_WRONG      /* A command the clean replay didn't have           */
+} fuzz_outcome_t;
+
+static fuzz_outcome_t compare_results(const replay_result_t *clean, const replay_result_t *fuzzed) {
+    uint32_t clean_count  = (clean->cmd_count < REPLAY_MAX_CMDS) ? clean->cmd_count : REPLAY_MAX_CMDS;
+    uint32_t fuzzed_count = (fuzzed->cmd_count < REPLAY_MAX_CMDS) ? fuzzed->cmd_count : REPLAY_MAX_CMDS;
+    uint32_t matched      = 0;
+
+    if (fuzzed->cmd_count > clean->cmd_count) {
+        return FUZZ_WRONG;
+    }
+
+    for (uint32_t i = 0; (i < clean_count) && (matched < fuzzed_count); i++) {
+        if (clean->cmds[i] == fuzzed->cmds[matched]) {
+            matched++;
+        }
+    }
+
+    if (matched < fuzzed_count) {
+        return FUZZ_WRONG;
+    }
+
+    return (fuzzed->cmd_count == clean->cmd_count) ? FUZZ_SAME : FUZZ_LOST;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "usage: %s [options] TRACE\n"
+        "  -f COUNT    replay COUNT fuzzed schedules instead of the trace itself\n"
+        "  -j MS       extra random delay for each toggle, 0 to MS (default 0)\n"
+        "  -d PCT      percentage of LED reports dropped (default 0)\n"
+        "  -m TRACE    mix the toggles of another trace in at a random offset\n"
+        "  -s SEED     random seed of the first schedule (default 1)\n"
+        "  -p          print each schedule as a trace instead of replaying it\n"
+        "  -a DEV      device number, which decides the addresses it answers to (default 1)\n"
+        "  -D PATH     simulated device library (default sim_device.so next to this program)\n"
+        "  -v          print device console output\n",
+        prog);
+}
+
+int main(int argc, char **argv) {
+    fuzz_params_t fuzz = { .jitter = 0, .drop_rate = 0.0, .mix = NULL };
+    trace_t       trace = { 0 };
+    trace_t       mix_trace = { 0 };
+    schedule_t    clean_schedule, mix_schedule, schedule;
+    uint32_t      schedules = 0;
+    uint64_t      seed = 1;
+    bool          print_schedules = false;
+    const char   *mix_path = NULL;
+    char          default_path[PATH_MAX];
+    char          self_path[PATH_MAX];
+    int           opt;
+
+    strncpy(self_path, argv[0], sizeof(self_path) - 1);
+    self_path[sizeof(self_path) - 1] = '\0';
+    snprintf(default_path, sizeof(default_path), "%s/sim_device.so", dirname(self_path));
+    device_path = default_path;
+
+    while ((opt = getopt(argc, argv, "f:j:d:m:s:pa:D:vh")) != -1) {
+        switch (opt) {
+            case 'f': schedules       = strtoul(optarg, NULL, 0); break;
+            case 'j': fuzz.jitter     = strtoul(optarg, NULL, 0); break;
+            case 'd': fuzz.drop_rate  = strtod(optarg, NULL) / 100.0; break;
+            case 'm': mix_path        = optarg; break;
+            case 's': seed            = strtoull(optarg, NULL, 0); break;
+            case 'p': print_schedules = true; break;
+            case 'a': device_id       = strtoul(optarg, NULL, 0); break;
+            case 'D': device_path     = optarg; break;
+            case 'v': verbose         = true; break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 2;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (!trace_read(argv[optind], &trace) ||
+        (mix_path && !trace_read(mix_path, &mix_trace))) {
+        return 1;
+    }
+
+    schedule_from_trace(&trace, &clean_schedule);
+
+    if (mix_path) {
+        schedule_from_trace(&mix_trace, &mix_schedule);
+        fuzz.mix = &mix_schedule;
+    }
+
+    /* The clean replay finds the device's own echoes, and without -f,
+     * shows what was decoded */
+    replay_result_t clean;
+
+    print_cmds = (schedules == 0);
+    replay(&clean_schedule, &clean);
+    print_cmds = false;
+
+    if (schedules == 0) {
+        printf("\n%u commands, %u frames dropped, %u of them timed out, %u resyncs, %u keys pressed\n",
+               clean.cmd_count, clean.counts.drops, clean.counts.timeouts,
+               clean.counts.resyncs, clean.presses);
+        return 0;
+    }
+
+    schedule.toggles = malloc((clean_schedule.count + (mix_path ? mix_schedule.count : 0)) * sizeof(toggle_t));
+    if (!schedule.toggles) {
+        perror("led_replay");
+        return 1;
+    }
+
+    uint32_t outcomes[3] = { 0, 0, 0 };
+    uint32_t drops = 0, timeouts = 0, resyncs = 0;
+    uint32_t shown = 0;
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (uint32_t s = 0; s < schedules; s++) {
+        replay_result_t fuzzed;
+
+        rng_state = (seed + s) ? (seed + s) : 1;
+        fuzz_schedule(&clean_schedule, &fuzz, &schedule);
+
+        if (print_schedules) {
+            schedule_print(&schedule);
+            continue;
+        }
+
+        replay(&schedule, &fuzzed);
+
+        fuzz_outcome_t outcome = compare_results(&clean, &fuzzed);
+
+        outcomes[outcome]++;
+        drops    += fuzzed.counts.drops;
+        timeouts += fuzzed.counts.timeouts;
+        resyncs  += fuzzed.counts.resyncs;
+
+        if ((outcome == FUZZ_WRONG) && (shown++ < REPLAY_MAX_SHOWN)) {
+            printf("wrong command with -s %llu\n", (unsigned long long)(seed + s));
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (print_schedules) {
+        return 0;
+    }
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%u schedules of %u commands in %.2f s, %.0f per second\n",
+           schedules, clean.cmd_count, seconds, schedules / seconds);
+    printf("same %u  lost %u  wrong %u\n",
+           outcomes[FUZZ_SAME], outcomes[FUZZ_LOST], outcomes[FUZZ_WRONG]);
+    printf("%u frames dropped, %u of them timed out, %u resyncs\n", drops, timeouts, resyncs);
+
+    return (outcomes[FUZZ_WRONG] > 0) ? 1 : 0;
+}
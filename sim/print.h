@@ -0,0 +1,26 @@
+/* Copyright 2022 Nick Nimchuk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+/* Stand-in for QMK's print.h. Console output from a simulated device
+ * is passed to the simulator, which prefixes it with the time and
+ * device name when verbose output is enabled. */
+
+void sim_print(const char *fmt, ...);
+
+#define uprint(s)    sim_print("%s", s)
+#define uprintf(...) sim_print(__VA_ARGS__)
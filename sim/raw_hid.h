@@ -0,0 +1,25 @@
+/* Copyright 2022 Nick Nimchuk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/* Stand-in for QMK's raw_hid.h. Reports sent by a simulated device go
+ * to the simulator, which can act as the host relay. */
+
+#include <stdint.h>
+
+void raw_hid_send(uint8_t *data, uint8_t length);
+
+void raw_hid_receive(uint8_t *data, uint8_t length);
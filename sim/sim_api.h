@@ -0,0 +1,78 @@
+/* Copyright 2022 Nick Nimchuk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+/* The interface between the simulated host and a simulated device.
+ *
+ * Each device is a separate copy of sim_device.so (features/led_comm.c
+ * plus the QMK stand-ins in sim_device.c), loaded into its own linker
+ * namespace so that every device has its own static state. The device
+ * calls back into the host through sim_host_ops_t, and the host drives
+ * the device through the exported sim_device_api table. */
+
+#include <stdarg.h>
+#include "sim_qmk.h"
+#include "led_enum.h"
+#include "features/led_comm.h"
+
+typedef struct {
+    uint32_t (*now)(void);
+    void     (*key_event)(uint8_t dev, uint8_t keycode, bool pressed);
+    void     (*command)(uint8_t dev, uintptr_t led_cmd);
+    void     (*log)(uint8_t dev, const char *fmt, va_list args);
+    void     (*raw_send)(uint8_t dev, const uint8_t *data, uint8_t length);
+} sim_host_ops_t;
+
+typedef struct {
+    void     (*attach)(const sim_host_ops_t *ops, uint8_t dev);
+    void     (*post_init)(led_t led_state);
+    void     (*led_update)(led_t led_state);
+    uint32_t (*send_cmd)(uintptr_t led_cmd);
+    void     (*raw_receive)(uint8_t *data, uint8_t length);
+    void     (*deferred_task)(void);
+    uint32_t (*next_deferred)(void);
+    uint8_t  (*deferred_used)(void);
+    led_rcv_counts_t (*rcv_counts)(void);
+    led_timing_t     (*timing)(void);
+    uint8_t          (*frame_symbols)(uintptr_t led_cmd);
+#   ifdef LED_CMD_STATS
+    led_cmd_stats_t  (*stats)(void);
+#   endif
+} sim_device_api_t;
+
+#define SIM_DEVICE_API "sim_device_api"
+
+/* The addresses each device answers to with LED_CMD_ADDRESS. Device 1
+ * is the left trackball and device 2 the right one, and the left one
+ * scrolls, as at startup in keymap.c. */
+static inline bool sim_addressed(uint8_t dev, uint8_t addr) {
+    switch (addr) {
+        case ADDR_ALL:
+            return true;
+
+        case ADDR_LEFT:
+        case ADDR_SCROLL:
+            return (dev == 1);
+
+        case ADDR_RIGHT:
+        case ADDR_MOVE:
+            return (dev == 2);
+
+        default:
+            return false;
+    }
+}
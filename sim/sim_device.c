@@ -0,0 +1,310 @@
+/* Copyright 2022 Nick Nimchuk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* QMK stand-ins for one simulated device. This is linked together with
+ * an unmodified features/led_comm.c into sim_device.so. */
+
+#include <stdint.h>
+#include "sim_qmk.h"
+#include "sim_api.h"
+#include "print.h"
+#include "raw_hid.h"
+#include "led_enum.h"
+#include "features/led_comm.h"
+
+static const sim_host_ops_t *host = NULL;
+static uint8_t               dev_id = 0;
+static led_t                 keyboard_led_state = { .raw = 0 };
+static uint32_t              eeconfig_user = 0;
+
+/* Deferred executor table, following quantum/deferred_exec.c */
+typedef struct {
+    deferred_token         token;
+    uint32_t               trigger_time;
+    deferred_exec_callback callback;
+    void                  *cb_arg;
+} deferred_executor_t;
+
+static deferred_executor_t executors[MAX_DEFERRED_EXECUTORS];
+static deferred_token      last_token = 0;
+
+uint32_t timer_read32(void) {
+    return host->now();
+}
+
+uint32_t timer_elapsed32(uint32_t last) {
+    return timer_read32() - last;
+}
+
+static deferred_token allocate_token(void) {
+    deferred_token first = ++last_token;
+
+    for (;;) {
+        if (last_token != INVALID_DEFERRED_TOKEN) {
+            bool in_use = false;
+
+            for (int i = 0; i < MAX_DEFERRED_EXECUTORS; ++i) {
+                if (executors[i].token == last_token) {
+                    in_use = true;
+                    break;
+                }
+            }
+
+            if (!in_use) {
+                return last_token;
+            }
+        }
+
+        if (++last_token == first) {
+            return INVALID_DEFERRED_TOKEN;
+        }
+    }
+}
+
+deferred_token defer_exec(uint32_t delay_ms, deferred_exec_callback callback, void *cb_arg) {
+    /* Zero-time delays are not queued, as in QMK */
+    if ((delay_ms == 0) || (callback == NULL)) {
+        return INVALID_DEFERRED_TOKEN;
+    }
+
+    for (int i = 0; i < MAX_DEFERRED_EXECUTORS; ++i) {
+        deferred_executor_t *entry = &executors[i];
+
+        if (entry->token == INVALID_DEFERRED_TOKEN) {
+            entry->token = allocate_token();
+            if (entry->token == INVALID_DEFERRED_TOKEN) {
+                return INVALID_DEFERRED_TOKEN;
+            }
+
+            entry->trigger_time = timer_read32() + delay_ms;
+            entry->callback     = callback;
+            entry->cb_arg       = cb_arg;
+            return entry->token;
+        }
+    }
+
+    sim_print("defer_exec: no free executor\n");
+    return INVALID_DEFERRED_TOKEN;
+}
+
+bool extend_deferred_exec(deferred_token token, uint32_t delay_ms) {
+    if ((delay_ms == 0) || (token == INVALID_DEFERRED_TOKEN)) {
+        return false;
+    }
+
+    for (int i = 0; i < MAX_DEFERRED_EXECUTORS; ++i) {
+        if (executors[i].token == token) {
+            executors[i].trigger_time = timer_read32() + delay_ms;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool cancel_deferred_exec(deferred_token token) {
+    if (token == INVALID_DEFERRED_TOKEN) {
+        return false;
+    }
+
+    for (int i = 0; i < MAX_DEFERRED_EXECUTORS; ++i) {
+        if (executors[i].token == token) {
+            executors[i].token    = INVALID_DEFERRED_TOKEN;
+            executors[i].callback = NULL;
+            executors[i].cb_arg   = NULL;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void deferred_task(void) {
+    uint32_t now = timer_read32();
+
+    for (int i = 0; i < MAX_DEFERRED_EXECUTORS; ++i) {
+        deferred_executor_t *entry = &executors[i];
+
+        if ((entry->token != INVALID_DEFERRED_TOKEN) &&
+            ((int32_t)(now - entry->trigger_time) >= 0)) {
+
+            uint32_t delay_ms = entry->callback(entry->trigger_time, entry->cb_arg);
+
+            if (delay_ms == 0) {
+                entry->token    = INVALID_DEFERRED_TOKEN;
+                entry->callback = NULL;
+                entry->cb_arg   = NULL;
+            } else {
+                entry->trigger_time += delay_ms;
+            }
+        }
+    }
+}
+
+static uint32_t next_deferred(void) {
+    uint32_t next = UINT32_MAX;
+
+    for (int i = 0; i < MAX_DEFERRED_EXECUTORS; ++i) {
+        if ((executors[i].token != INVALID_DEFERRED_TOKEN) &&
+            (executors[i].trigger_time < next)) {
+            next = executors[i].trigger_time;
+        }
+    }
+
+    return next;
+}
+
+static uint8_t deferred_used(void) {
+    uint8_t used = 0;
+
+    for (int i = 0; i < MAX_DEFERRED_EXECUTORS; ++i) {
+        if (executors[i].token != INVALID_DEFERRED_TOKEN) {
+            used++;
+        }
+    }
+
+    return used;
+}
+
+/* Key events are passed to the host, which toggles the lock and
+ * reflects the new LED state to every attached device. */
+void register_code(uint8_t keycode) {
+    host->key_event(dev_id, keycode, true);
+}
+
+void unregister_code(uint8_t keycode) {
+    host->key_event(dev_id, keycode, false);
+}
+
+uint8_t sim_device_id(void) {
+    return dev_id;
+}
+
+led_t host_keyboard_led_state(void) {
+    return keyboard_led_state;
+}
+
+uint32_t eeconfig_read_user(void) {
+    return eeconfig_user;
+}
+
+void eeconfig_update_user(uint32_t val) {
+    eeconfig_user = val;
+}
+
+void raw_hid_send(uint8_t *data, uint8_t length) {
+    host->raw_send(dev_id, data, length);
+}
+
+void sim_print(const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    host->log(dev_id, fmt, args);
+    va_end(args);
+}
+
+/* Every simulated device reports completed commands to the host. Only
+ * one device should acknowledge each command, so only the first
+ * trackball does, much like the movement trackball in keymap.c, unless
+ * the command was sent to one trackball. */
+bool process_led_cmd(uintptr_t led_cmd) {
+    host->command(dev_id, led_cmd);
+    return((dev_id == 1) || (LED_CMD_ADDR(led_cmd) != ADDR_ALL));
+}
+
+/* Devices answer to the same addresses that led_bench expects */
+bool led_cmd_addressed(uint8_t addr) {
+    return(sim_addressed(dev_id, addr));
+}
+
+/* The simulated keyboard coalesces queued commands like the example
+ * keyboard keymap in the readme. */
+led_cmd_coalesce_t coalesce_led_cmd(uintptr_t queued_cmd, uintptr_t led_cmd) {
+    uintptr_t queued = LED_CMD_OPCODE(queued_cmd);
+
+    switch (LED_CMD_OPCODE(led_cmd)) {
+        case LFT_MOUSE:
+        case RGT_MOUSE:
+            if ((queued == LFT_MOUSE) || (queued == RGT_MOUSE)) {
+                return LED_CMD_REPLACE;
+            }
+            break;
+
+        case ACT_HI_DPI:
+        case ACT_MID_DPI:
+        case ACT_LOW_DPI:
+            if ((queued == ACT_HI_DPI) || (queued == ACT_MID_DPI) ||
+                (queued == ACT_LOW_DPI)) {
+                return LED_CMD_REPLACE;
+            }
+            break;
+    }
+
+    return LED_CMD_KEEP;
+}
+
+/* Reports from the relay are passed on as in the readme */
+void raw_hid_receive(uint8_t *data, uint8_t length) {
+#   ifdef LED_CMD_RAW_HID
+    led_raw_receive(data, length);
+#   endif
+}
+
+#ifdef LED_CMD_HUFFMAN
+const uint8_t led_cmd_weights[LED_CMD_COUNT] = LED_CMD_WEIGHTS;
+#endif
+
+#ifdef LED_CMD_ARGS
+const uint8_t led_cmd_arg_bits[LED_CMD_COUNT] = LED_CMD_ARG_BITS;
+#endif
+
+static void attach(const sim_host_ops_t *ops, uint8_t dev) {
+    host   = ops;
+    dev_id = dev;
+}
+
+static void post_init(led_t led_state) {
+    keyboard_led_state = led_state;
+    keyboard_post_init_user();
+}
+
+static void led_update(led_t led_state) {
+    keyboard_led_state = led_state;
+    led_update_user(led_state);
+}
+
+static uint32_t send_cmd(uintptr_t led_cmd) {
+    return send_led_cmd(led_cmd);
+}
+
+__attribute__ ((visibility("default")))
+const sim_device_api_t sim_device_api = {
+    .attach        = attach,
+    .post_init     = post_init,
+    .led_update    = led_update,
+    .send_cmd      = send_cmd,
+    .raw_receive   = raw_hid_receive,
+    .deferred_task = deferred_task,
+    .next_deferred = next_deferred,
+    .deferred_used = deferred_used,
+    .rcv_counts    = led_rcv_counts,
+    .timing        = led_cmd_timing,
+    .frame_symbols = led_cmd_frame_symbols,
+#   ifdef LED_CMD_STATS
+    .stats         = led_cmd_stats
+#   endif
+};
@@ -0,0 +1,510 @@
+/* Copyright 2022 Nick Nimchuk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A discrete-event model of a host with several QMK devices attached.
+ * Time advances in whole milliseconds, like the QMK timer. At each
+ * step, host events that are due are processed first, then any changed
+ * LED state is passed to each device (once per step, like led_task),
+ * and finally each device runs its deferred executor. */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim_host.h"
+
+#define SIM_MAX_EVENTS 4096
+
+typedef enum {
+    EV_KEY,         /* A key event arrives at the host          */
+    EV_LED,         /* An LED report arrives at a device        */
+    EV_RAW_RELAY,   /* A raw HID report arrives at the relay    */
+    EV_RAW_DEVICE   /* A raw HID report arrives at a device     */
+} sim_event_type_t;
+
+typedef struct {
+    uint32_t         time;
+    uint32_t         seq;
+    sim_event_type_t type;
+    uint8_t          dev;
+    uint8_t          keycode;
+    bool             pressed;
+    led_t            led_state;
+    uint8_t          raw[LED_RAW_SIZE];
+} sim_event_t;
+
+typedef struct {
+    const char             *name;
+    const sim_device_api_t *api;
+    led_t                   led_state;
+    led_t                   pending_led_state;
+    uint32_t                key_free_time;  /* Next free USB frame */
+    uint32_t                led_free_time;
+    uint32_t                raw_send_free_time;
+    uint32_t                raw_rcv_free_time;
+    uint32_t                press_time[8];
+} sim_device_t;
+
+static sim_params_t   params;
+static const char    *device_path;
+static sim_device_t   devices[SIM_MAX_DEVICES];
+static uint8_t        device_count = 0;
+static sim_event_t    events[SIM_MAX_EVENTS];
+static uint32_t       event_count = 0;
+static uint32_t       event_seq = 0;
+static uint32_t       now_ms = 0;
+static uint64_t       rng_state = 1;
+static led_t          host_led_state = { .raw = 0 };
+static sim_command_cb command_cb = NULL;
+static void          *command_ctx = NULL;
+static FILE          *trace_file = NULL;
+static uint8_t        trace_dev = 0;
+static bool           relay_started = false;
+
+/* xorshift64* */
+uint32_t sim_random(uint32_t range) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+
+    if (range == 0) {
+        return 0;
+    }
+    return (uint32_t)((rng_state * 0x2545F4914F6CDD1DULL) >> 32) % range;
+}
+
+static bool event_before(const sim_event_t *a, const sim_event_t *b) {
+    return (a->time < b->time) || ((a->time == b->time) && (a->seq < b->seq));
+}
+
+static void push_event(sim_event_t event) {
+    if (event_count == SIM_MAX_EVENTS) {
+        fprintf(stderr, "sim: event queue overflow\n");
+        exit(1);
+    }
+
+    event.seq = event_seq++;
+
+    uint32_t i = event_count++;
+    while (i > 0) {
+        uint32_t parent = (i - 1) / 2;
+        if (!event_before(&event, &events[parent])) {
+            break;
+        }
+        events[i] = events[parent];
+        i = parent;
+    }
+    events[i] = event;
+}
+
+static sim_event_t pop_event(void) {
+    sim_event_t top  = events[0];
+    sim_event_t last = events[--event_count];
+    uint32_t    i    = 0;
+
+    for (;;) {
+        uint32_t child = 2 * i + 1;
+        if (child >= event_count) {
+            break;
+        }
+        if ((child + 1 < event_count) && event_before(&events[child + 1], &events[child])) {
+            child++;
+        }
+        if (!event_before(&events[child], &last)) {
+            break;
+        }
+        events[i] = events[child];
+        i = child;
+    }
+    events[i] = last;
+
+    return top;
+}
+
+static uint32_t jitter(void) {
+    return sim_random(params.jitter + 1);
+}
+
+static uint8_t lock_mask(uint8_t keycode) {
+    switch (keycode) {
+        case KC_NUM:  return 1 << 0;
+        case KC_CAPS: return 1 << 1;
+        case KC_SCRL: return 1 << 2;
+        default:      return 0;
+    }
+}
+
+/* Toggle a lock on the host and report the new state to every device.
+ * Each report may be dropped, in which case the device only notices
+ * the change if a later report differs from what it last saw. */
+static void toggle_lock(uint8_t mask) {
+    host_led_state.raw ^= mask;
+
+    for (uint8_t i = 0; i < device_count; i++) {
+        if (sim_random(1000000) < (uint32_t)(params.drop_rate * 1000000.0)) {
+            continue;
+        }
+
+        uint32_t time = now_ms + params.led_latency + jitter();
+        if (time < devices[i].led_free_time) {
+            time = devices[i].led_free_time;
+        }
+        devices[i].led_free_time = time + 1;
+
+        push_event((sim_event_t){
+            .time = time, .type = EV_LED, .dev = i, .led_state = host_led_state
+        });
+    }
+}
+
+static void host_key_event(uint8_t dev, uint8_t keycode, bool pressed) {
+    uint8_t mask = lock_mask(keycode);
+    uint8_t slot = keycode & 7;
+
+    if (mask == 0) {
+        return;
+    }
+
+    if (pressed) {
+        devices[dev].press_time[slot] = now_ms;
+        if (params.min_hold == 0) {
+            toggle_lock(mask);
+        }
+    } else if ((params.min_hold > 0) &&
+               (now_ms - devices[dev].press_time[slot] >= params.min_hold)) {
+        toggle_lock(mask);
+    }
+}
+
+/* Pass a raw HID report to a device, in order after any before it */
+static void raw_to_device(uint8_t dev, const uint8_t *data) {
+    uint32_t time = now_ms + params.led_latency + jitter();
+
+    if (time < devices[dev].raw_rcv_free_time) {
+        time = devices[dev].raw_rcv_free_time;
+    }
+    devices[dev].raw_rcv_free_time = time + 1;
+
+    sim_event_t event = { .time = time, .type = EV_RAW_DEVICE, .dev = dev };
+    memcpy(event.raw, data, LED_RAW_SIZE);
+    push_event(event);
+}
+
+static bool relay_running(void) {
+    return params.relay && (now_ms >= params.relay_start) &&
+           ((params.relay_stop == 0) || (now_ms < params.relay_stop));
+}
+
+/* The relay, as in relay/led_relay.c. Pings are answered, and each
+ * command is passed to every other device and then acknowledged, if
+ * there was one to pass it to. */
+static void relay_receive(uint8_t dev, uint8_t *data) {
+    if (!relay_running() || (data[LED_RAW_MAGIC_AT] != LED_RAW_MAGIC)) {
+        return;
+    }
+
+    switch (data[LED_RAW_TYPE_AT]) {
+        case LED_RAW_PING:
+            data[LED_RAW_TYPE_AT] = LED_RAW_PONG;
+            raw_to_device(dev, data);
+            break;
+
+        case LED_RAW_CMD: {
+            uint8_t forwarded = 0;
+
+            for (uint8_t i = 0; i < device_count; i++) {
+                if (i != dev) {
+                    raw_to_device(i, data);
+                    forwarded++;
+                }
+            }
+
+            if (forwarded > 0) {
+                data[LED_RAW_TYPE_AT] = LED_RAW_ACK;
+                raw_to_device(dev, data);
+            }
+            break;
+        }
+    }
+}
+
+/* Once it starts, the relay tells every device it is there */
+static void relay_start(void) {
+    uint8_t data[LED_RAW_SIZE] = { [LED_RAW_MAGIC_AT] = LED_RAW_MAGIC, [LED_RAW_TYPE_AT] = LED_RAW_PONG };
+
+    relay_started = true;
+    for (uint8_t i = 0; i < device_count; i++) {
+        raw_to_device(i, data);
+    }
+}
+
+/* Host callbacks used by the devices */
+
+static uint32_t ops_now(void) {
+    return now_ms;
+}
+
+static void ops_key_event(uint8_t dev, uint8_t keycode, bool pressed) {
+    uint32_t time = now_ms + params.key_latency + jitter();
+
+    if (time < devices[dev].key_free_time) {
+        time = devices[dev].key_free_time;
+    }
+    devices[dev].key_free_time = time + 1;
+
+    push_event((sim_event_t){
+        .time = time, .type = EV_KEY, .dev = dev, .keycode = keycode, .pressed = pressed
+    });
+}
+
+static void ops_command(uint8_t dev, uintptr_t led_cmd) {
+    if (command_cb) {
+        command_cb(dev, led_cmd, command_ctx);
+    }
+}
+
+/* Reports only reach the relay while it is running, and are otherwise
+ * lost, as when no program has the raw HID interface open */
+static void ops_raw_send(uint8_t dev, const uint8_t *data, uint8_t length) {
+    uint32_t time = now_ms + params.key_latency + jitter();
+
+    if (length != LED_RAW_SIZE) {
+        return;
+    }
+
+    if (time < devices[dev].raw_send_free_time) {
+        time = devices[dev].raw_send_free_time;
+    }
+    devices[dev].raw_send_free_time = time + 1;
+
+    sim_event_t event = { .time = time, .type = EV_RAW_RELAY, .dev = dev };
+    memcpy(event.raw, data, LED_RAW_SIZE);
+    push_event(event);
+}
+
+static void ops_log(uint8_t dev, const char *fmt, va_list args) {
+    if (params.verbose) {
+        fprintf(stderr, "%8u %-8s ", now_ms, devices[dev].name);
+        vfprintf(stderr, fmt, args);
+    }
+}
+
+static const sim_host_ops_t host_ops = {
+    .now       = ops_now,
+    .key_event = ops_key_event,
+    .command   = ops_command,
+    .log       = ops_log,
+    .raw_send  = ops_raw_send
+};
+
+void sim_init(const sim_params_t *sim_params, const char *path) {
+    params      = *sim_params;
+    device_path = path;
+    rng_state   = params.seed ? params.seed : 1;
+
+    if (params.key_latency == 0) {
+        params.key_latency = 1;
+    }
+    if (params.led_latency == 0) {
+        params.led_latency = 1;
+    }
+}
+
+/* Load a fresh copy of the device library into its own namespace, so
+ * the static state in led_comm.c is not shared between devices. */
+uint8_t sim_add_device(const char *name) {
+    if (device_count == SIM_MAX_DEVICES) {
+        fprintf(stderr, "sim: too many devices\n");
+        exit(1);
+    }
+
+    void *handle = dlmopen(LM_ID_NEWLM, device_path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        fprintf(stderr, "sim: %s\n", dlerror());
+        exit(1);
+    }
+
+    const sim_device_api_t *api = dlsym(handle, SIM_DEVICE_API);
+    if (!api) {
+        fprintf(stderr, "sim: %s\n", dlerror());
+        exit(1);
+    }
+
+    uint8_t dev = device_count++;
+    devices[dev] = (sim_device_t){
+        .name              = name,
+        .api               = api,
+        .led_state         = host_led_state,
+        .pending_led_state = host_led_state
+    };
+
+    api->attach(&host_ops, dev);
+    api->post_init(host_led_state);
+
+    return dev;
+}
+
+void sim_set_command_cb(sim_command_cb callback, void *ctx) {
+    command_cb  = callback;
+    command_ctx = ctx;
+}
+
+/* Write every LED state one device sees to a file, as the time in ms
+ * and the host LED state, for led_replay. */
+void sim_set_trace(FILE *file, uint8_t dev) {
+    trace_file = file;
+    trace_dev  = dev;
+
+    if (trace_file) {
+        fprintf(trace_file, "%u %u\n", now_ms, devices[dev].led_state.raw);
+    }
+}
+
+uint32_t sim_now(void) {
+    return now_ms;
+}
+
+led_t sim_host_led_state(void) {
+    return host_led_state;
+}
+
+uint32_t sim_send_cmd(uint8_t dev, uintptr_t led_cmd) {
+    return devices[dev].api->send_cmd(led_cmd);
+}
+
+led_rcv_counts_t sim_rcv_counts(uint8_t dev) {
+    return devices[dev].api->rcv_counts();
+}
+
+led_timing_t sim_timing(uint8_t dev) {
+    return devices[dev].api->timing();
+}
+
+uint8_t sim_frame_symbols(uint8_t dev, uintptr_t led_cmd) {
+    return devices[dev].api->frame_symbols(led_cmd);
+}
+
+#ifdef LED_CMD_STATS
+led_cmd_stats_t sim_stats(uint8_t dev) {
+    return devices[dev].api->stats();
+}
+#endif
+
+bool sim_idle(void) {
+    if (event_count > 0) {
+        return false;
+    }
+
+    for (uint8_t i = 0; i < device_count; i++) {
+        if (devices[i].api->deferred_used() > 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* The next time anything can happen, always after the current step */
+static uint32_t next_time(void) {
+    uint32_t next = (event_count > 0) ? events[0].time : UINT32_MAX;
+
+    for (uint8_t i = 0; i < device_count; i++) {
+        uint32_t deferred = devices[i].api->next_deferred();
+        if (deferred < next) {
+            next = deferred;
+        }
+    }
+
+    if (next <= now_ms) {
+        next = now_ms + 1;
+    }
+
+    return next;
+}
+
+static void step(uint32_t time) {
+    now_ms = time;
+
+    if (!relay_started && relay_running()) {
+        relay_start();
+    }
+
+    while ((event_count > 0) && (events[0].time <= now_ms)) {
+        sim_event_t event = pop_event();
+
+        switch (event.type) {
+            case EV_KEY:
+                host_key_event(event.dev, event.keycode, event.pressed);
+                break;
+
+            case EV_LED:
+                devices[event.dev].pending_led_state = event.led_state;
+                break;
+
+            case EV_RAW_RELAY:
+                relay_receive(event.dev, event.raw);
+                break;
+
+            case EV_RAW_DEVICE:
+                devices[event.dev].api->raw_receive(event.raw, LED_RAW_SIZE);
+                break;
+        }
+    }
+
+    for (uint8_t i = 0; i < device_count; i++) {
+        if (devices[i].pending_led_state.raw != devices[i].led_state.raw) {
+            devices[i].led_state = devices[i].pending_led_state;
+            devices[i].api->led_update(devices[i].led_state);
+
+            if (trace_file && (i == trace_dev)) {
+                fprintf(trace_file, "%u %u\n", now_ms, devices[i].led_state.raw);
+            }
+        }
+    }
+
+    for (uint8_t i = 0; i < device_count; i++) {
+        devices[i].api->deferred_task();
+    }
+}
+
+void sim_run_until(uint32_t end_time) {
+    uint32_t next;
+
+    while ((next = next_time()) <= end_time) {
+        step(next);
+    }
+
+    if (end_time > now_ms) {
+        now_ms = end_time;
+    }
+}
+
+bool sim_run_until_idle(uint32_t limit) {
+    uint32_t deadline = now_ms + limit;
+
+    while (!sim_idle()) {
+        uint32_t next = next_time();
+
+        if (next > deadline) {
+            now_ms = deadline;
+            return false;
+        }
+        step(next);
+    }
+
+    return true;
+}
@@ -0,0 +1,78 @@
+/* Copyright 2022 Nick Nimchuk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include "sim_api.h"
+
+#define SIM_MAX_DEVICES 4
+
+/* Timing model of the simulated host. Every key event from a device
+ * reaches the host after key_latency plus a random 0..jitter ms, and
+ * every LED report reaches each device after led_latency plus its own
+ * random jitter. Events from (and to) a single device stay in order,
+ * at most one per millisecond. With relay set, the host also runs the
+ * raw HID relay from relay_start until relay_stop ms (0 for the whole
+ * run), and each raw HID report takes the same latencies. */
+typedef struct {
+    uint32_t key_latency;   /* Base delay from key event to host       */
+    uint32_t led_latency;   /* Base delay from lock toggle to device   */
+    uint32_t jitter;        /* Extra random delay, 0 to jitter ms      */
+    uint32_t min_hold;      /* Shorter lock key presses are ignored    */
+    double   drop_rate;     /* Chance that an LED report is lost       */
+    bool     relay;         /* Pass raw HID reports between devices    */
+    uint32_t relay_start;   /* When the relay starts                   */
+    uint32_t relay_stop;    /* When it stops, or 0 to keep running     */
+    uint64_t seed;
+    bool     verbose;       /* Print device console output             */
+} sim_params_t;
+
+typedef void (*sim_command_cb)(uint8_t dev, uintptr_t led_cmd, void *ctx);
+
+#define SIM_PARAMS_DEFAULT {    \
+    .key_latency = 1,           \
+    .led_latency = 1,           \
+    .jitter      = 0,           \
+    .min_hold    = 0,           \
+    .drop_rate   = 0.0,         \
+    .relay       = false,       \
+    .relay_start = 0,           \
+    .relay_stop  = 0,           \
+    .seed        = 1,           \
+    .verbose     = false        \
+}
+
+void     sim_init(const sim_params_t *params, const char *device_path);
+uint8_t  sim_add_device(const char *name);
+void     sim_set_command_cb(sim_command_cb callback, void *ctx);
+void     sim_set_trace(FILE *file, uint8_t dev);
+
+uint32_t sim_now(void);
+led_t    sim_host_led_state(void);
+uint32_t sim_send_cmd(uint8_t dev, uintptr_t led_cmd);
+led_rcv_counts_t sim_rcv_counts(uint8_t dev);
+led_timing_t     sim_timing(uint8_t dev);
+uint8_t          sim_frame_symbols(uint8_t dev, uintptr_t led_cmd);
+#ifdef LED_CMD_STATS
+led_cmd_stats_t  sim_stats(uint8_t dev);
+#endif
+
+bool     sim_idle(void);
+void     sim_run_until(uint32_t end_time);
+bool     sim_run_until_idle(uint32_t limit);
+
+uint32_t sim_random(uint32_t range);
@@ -0,0 +1,90 @@
+/* Copyright 2022 Nick Nimchuk
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+/* Stand-in for QMK_KEYBOARD_H when building the LED communication
+ * feature for the host-native simulator. Only the small part of the
+ * QMK API that features/led_comm.c uses is declared here, with the
+ * same names and types as the real firmware. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef TAP_CODE_DELAY
+#define TAP_CODE_DELAY 0
+#endif
+
+#ifndef TAP_HOLD_CAPS_DELAY
+#define TAP_HOLD_CAPS_DELAY 80
+#endif
+
+#ifndef MAX_DEFERRED_EXECUTORS
+#define MAX_DEFERRED_EXECUTORS 8
+#endif
+
+/* Lock keycodes, matching the HID usage IDs used by QMK */
+enum {
+    KC_NO   = 0x00,
+    KC_CAPS = 0x39,
+    KC_SCRL = 0x47,
+    KC_NUM  = 0x53
+};
+
+typedef union {
+    uint8_t raw;
+    struct {
+        bool    num_lock    : 1;
+        bool    caps_lock   : 1;
+        bool    scroll_lock : 1;
+        bool    compose     : 1;
+        bool    kana        : 1;
+        uint8_t reserved    : 3;
+    };
+} led_t;
+
+/* Deferred execution */
+typedef uint8_t deferred_token;
+typedef uint32_t (*deferred_exec_callback)(uint32_t trigger_time, void *cb_arg);
+
+#define INVALID_DEFERRED_TOKEN 0
+
+deferred_token defer_exec(uint32_t delay_ms, deferred_exec_callback callback, void *cb_arg);
+bool           extend_deferred_exec(deferred_token token, uint32_t delay_ms);
+bool           cancel_deferred_exec(deferred_token token);
+
+/* Timer */
+uint32_t timer_read32(void);
+uint32_t timer_elapsed32(uint32_t last);
+
+/* Key events */
+void register_code(uint8_t keycode);
+void unregister_code(uint8_t keycode);
+
+/* Host LED state */
+led_t host_keyboard_led_state(void);
+
+/* User EEPROM word, which starts out blank */
+uint32_t eeconfig_read_user(void);
+void     eeconfig_update_user(uint32_t val);
+
+/* Number of the simulated device, used as LED_DEVICE_ID */
+uint8_t sim_device_id(void);
+
+/* User hooks */
+bool led_update_user(led_t led_state);
+void keyboard_post_init_user(void);